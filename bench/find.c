@@ -0,0 +1,82 @@
+// Search micro-benchmark: counts the rows of a file holding a pattern, once with the
+// editor's search engine and once with a naive strstr() per row, and prints both timings.
+//
+//     make bench-find
+//     ./bench/find FILE PATTERN
+
+#define ZTEXT_NO_MAIN
+#include "../main.c"
+
+#define BENCH_RUNS 5
+
+typedef int (*benchCounter)(const char *pattern);
+
+int countMemSearch(const char *pattern){
+    size_t patternLength = strlen(pattern);
+    int matches = 0;
+    int column;
+
+    for (int i = 0; i < editor.numChunks; i++) {
+        int offset = 0;
+        while ((offset = editorSearchChunk(editor.chunks[i], offset, pattern, patternLength, &column)) != -1) {
+            matches++;
+            offset++;
+        }
+    }
+    return matches;
+}
+
+int countStrstr(const char *pattern){
+    int matches = 0;
+
+    for (int i = 0; i < editor.numChunks; i++) {
+        editorRowChunk *chunk = editor.chunks[i];
+        for (int j = 0; j < chunk->count; j++) {
+            if (strstr(chunk->rows[j].chars, pattern)) matches++;
+        }
+    }
+    return matches;
+}
+
+// Best of BENCH_RUNS, in ms
+double timeCounter(benchCounter counter, const char *pattern, int *matches){
+    double best = -1;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        *matches = counter(pattern);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        if (best < 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]){
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s FILE PATTERN\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    editorOpen(argv[1]);
+    // Big files load in the background, the search has to see all of it
+    editorFinishLoad();
+
+    long long bytes = 0;
+    for (int i = 0; i < editor.numChunks; i++) {
+        for (int j = 0; j < editor.chunks[i]->count; j++) bytes += editor.chunks[i]->rows[j].size;
+    }
+
+    int fast, naive;
+    double fastMs = timeCounter(countMemSearch, argv[2], &fast);
+    double naiveMs = timeCounter(countStrstr, argv[2], &naive);
+
+    printf("%d rows, %lld bytes, pattern \"%s\"\n", editor.numRows, bytes, argv[2]);
+    printf("ztext search:    %8.2f ms  %7.2f GB/s  %d matching rows\n", fastMs, bytes / fastMs / 1e6, fast);
+    printf("strstr:          %8.2f ms  %7.2f GB/s  %d matching rows\n", naiveMs, bytes / naiveMs / 1e6, naive);
+
+    return fast == naive ? EXIT_SUCCESS : EXIT_FAILURE;
+}
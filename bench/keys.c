@@ -0,0 +1,344 @@
+// Headless key-script benchmark: replays scripted key streams against generated files of
+// growing size on a virtual terminal, and prints per-key latency, bytes written per frame
+// and peak RSS for each workload.
+//
+//     make bench
+//     ./bench/keys [-s ROWSxCOLUMNS] [MB...]
+//     ./bench/keys [-s ROWSxCOLUMNS] -k KEYS FILE
+//
+// The second form replays the raw terminal bytes in KEYS against FILE instead.
+// Every workload runs in its own process, so peak RSS is that workload's alone.
+
+#define ZTEXT_NO_MAIN
+#include "../main.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_ROWS 50
+#define BENCH_COLUMNS 160
+#define BENCH_PASTE_BYTES (64 << 10)
+
+typedef struct{
+    const char *name;
+    void (*script)(struct appendBuffer *keys);
+} benchWorkload;
+
+typedef struct{
+    double *latencies;
+    int count;
+    int capacity;
+} benchSamples;
+
+void scriptOpen(struct appendBuffer *keys);
+void scriptType(struct appendBuffer *keys);
+void scriptPaste(struct appendBuffer *keys);
+void scriptScroll(struct appendBuffer *keys);
+void scriptSave(struct appendBuffer *keys);
+
+benchWorkload workloads[] = {
+    {"open", scriptOpen},
+    {"type", scriptType},
+    {"paste", scriptPaste},
+    {"scroll", scriptScroll},
+    {"save", scriptSave},
+};
+
+#define BENCH_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+void abAppendString(struct appendBuffer *keys, const char *s){
+    abAppend(keys, s, strlen(s));
+}
+
+void abAppendRepeated(struct appendBuffer *keys, const char *s, int times){
+    while (times--) abAppendString(keys, s);
+}
+
+// Nothing to press, opening the file and drawing it is all there is
+void scriptOpen(struct appendBuffer *keys){
+    (void)keys;
+}
+
+// Half way into the file, then a few lines of code typed one key at a time with the odd typo
+void scriptType(struct appendBuffer *keys){
+    const char *line = "\tfor (int i = 0; i < count; i++) total += values[i];\r";
+
+    abAppendString(keys, "\x07" "50%\r");
+    for (int i = 0; i < 40; i++) {
+        abAppendString(keys, line);
+        if (i % 4 == 0) abAppendString(keys, "tpyo\x7f\x7f\x7f\x7f");
+    }
+}
+
+void scriptPaste(struct appendBuffer *keys){
+    abAppendString(keys, "\x07" "50%\r");
+    for (int i = 0; i < 16; i++) {
+        abAppendString(keys, "\x1b[200~");
+        for (int written = 0; written < BENCH_PASTE_BYTES; written += 32) {
+            abAppendString(keys, "pasted text, tab\there and end \n");
+        }
+        abAppendString(keys, "\x1b[201~");
+    }
+}
+
+void scriptScroll(struct appendBuffer *keys){
+    abAppendRepeated(keys, "\x1b[6~", 200);
+    abAppendRepeated(keys, "\x1b[B", 1000);
+    abAppendRepeated(keys, "\x1b[C", 100);
+    abAppendRepeated(keys, "\x1b[5~", 200);
+    abAppendString(keys, "\x07" "90%\r");
+    abAppendRepeated(keys, "\x1b[A", 500);
+    abAppendString(keys, "\x1b[F\x1b[H");
+}
+
+// Saves run in the background, so typing goes on while they do
+void scriptSave(struct appendBuffer *keys){
+    abAppendString(keys, "\x07" "50%\r");
+    for (int i = 0; i < 8; i++) {
+        abAppendString(keys, "\x13");
+        abAppendRepeated(keys, "x", 50);
+    }
+}
+
+// About `megabytes` of C-ish lines with tabs, comments and the odd UTF-8 string, so the
+// highlighter and the column mapping both have some work to do
+char* generateFile(int megabytes){
+    static char path[] = "/tmp/ztext-bench-XXXXXX.c";
+    strcpy(path, "/tmp/ztext-bench-XXXXXX.c");
+    int fd = mkstemps(path, 2);
+    if (fd == -1)
+    {
+        perror("Cannot create bench file");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *file = fdopen(fd, "w");
+    long long target = (long long)megabytes << 20;
+    long long written = 0;
+    for (int i = 0; written < target; i++) {
+        switch (i % 4)
+        {
+            case 0:
+                written += fprintf(file, "int value%d = compute(%d, \"caf\xc3\xa9 %d\");\n", i, i * 7, i);
+                break;
+            case 1:
+                written += fprintf(file, "\tif (value%d > %d) return value%d; // \xe4\xb8\xad\xe6\x96\x87 note\n", i - 1, i, i - 1);
+                break;
+            case 2:
+                written += fprintf(file, "\t\t/* block %d */ total += values[%d] * %d;\n", i, i % 100, i);
+                break;
+            default:
+                written += fprintf(file, "\n");
+                break;
+        }
+    }
+    fclose(file);
+    return path;
+}
+
+long long benchNanoseconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void addSample(benchSamples *samples, double ms){
+    if (samples->count == samples->capacity)
+    {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->latencies = realloc(samples->latencies, sizeof(double) * samples->capacity);
+        if (samples->latencies == NULL) printEditorError("Cannot allocate samples");
+    }
+    samples->latencies[samples->count++] = ms;
+}
+
+int compareDoubles(const void *a, const void *b){
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(benchSamples *samples, int p){
+    if (samples->count == 0) return 0;
+    return samples->latencies[(samples->count - 1) * p / 100];
+}
+
+// Runs in the child. The editor reads the keys as if they were typed into its terminal and
+// draws into /dev/null, one frame per key
+void runWorkload(const char *label, const char *name, char *fileName, const char *keys, int keysLength,
+    int rows, int columns, int report){
+    char keysPath[] = "/tmp/ztext-keys-XXXXXX";
+    int keysFd = mkstemp(keysPath);
+    if (keysFd == -1 || writeAll(keysFd, keys, keysLength) == -1)
+    {
+        perror("Cannot write key script");
+        exit(EXIT_FAILURE);
+    }
+    unlink(keysPath);
+    lseek(keysFd, 0, SEEK_SET);
+    dup2(keysFd, STDIN_FILENO);
+    close(keysFd);
+
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    benchSamples samples = {0};
+    initializeEditorSized(rows, columns);
+
+    long long start = benchNanoseconds();
+    editorOpen(fileName);
+    refreshScreen();
+    addSample(&samples, (benchNanoseconds() - start) / 1e6);
+
+    // Open is timed to the first frame, the keys get the whole file
+    editorFinishLoad();
+
+    // Frames while typing are the interesting ones, unless there's no typing at all
+    if (keysLength)
+    {
+        editor.totalBytes = 0;
+        editor.frames = 0;
+    }
+    long long consumed = 0;
+    while (consumed < keysLength)
+    {
+        long long keyStart = benchNanoseconds();
+        processKey(readKey());
+        refreshScreen();
+        addSample(&samples, (benchNanoseconds() - keyStart) / 1e6);
+
+        // What the event loop would do between keys
+        handleWorkers();
+        consumed = lseek(STDIN_FILENO, 0, SEEK_CUR) - editor.inputLength;
+    }
+    editorFinishSave();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // The open sample is the only one for "open", everything else reports the keys alone
+    int keyCount = keysLength ? samples.count - 1 : 1;
+    double openMs = samples.latencies[0];
+    if (keysLength)
+    {
+        memmove(samples.latencies, samples.latencies + 1, sizeof(double) * keyCount);
+        samples.count = keyCount;
+    }
+    qsort(samples.latencies, samples.count, sizeof(double), compareDoubles);
+
+    char line[256];
+    int length = snprintf(line, sizeof(line), "%-9s %-8s %7d %9.1f %9.3f %9.3f %9.3f %11.0f %9ld\n",
+        label, name, keyCount, openMs, percentile(&samples, 50), percentile(&samples, 99),
+        samples.latencies[samples.count - 1], editor.frames ? (double)editor.totalBytes / editor.frames : 0,
+        usage.ru_maxrss / 1024);
+    writeAll(report, line, length);
+    exit(EXIT_SUCCESS);
+}
+
+// Forks a child for the workload and waits for it. Returns false if it didn't make it
+bool benchWorkloadRun(const char *label, const char *name, char *fileName, const char *keys, int keysLength,
+    int rows, int columns){
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0)
+    {
+        int report = dup(STDOUT_FILENO);
+        runWorkload(label, name, fileName, keys, keysLength, rows, columns, report);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "%s %s: workload failed\n", label, name);
+        return false;
+    }
+    return true;
+}
+
+void printHeader(int rows, int columns){
+    printf("%dx%d virtual terminal, latencies in ms per key (open: time to the first frame)\n", rows, columns);
+    printf("%-9s %-8s %7s %9s %9s %9s %9s %11s %9s\n",
+        "file", "workload", "keys", "open", "p50", "p99", "max", "bytes/frame", "peak MB");
+}
+
+int main(int argc, char *argv[]){
+    int rows = BENCH_ROWS;
+    int columns = BENCH_COLUMNS;
+    const char *keysFile = NULL;
+    int arg = 1;
+
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc &&
+            sscanf(argv[arg + 1], "%dx%d", &rows, &columns) == 2 && rows > 2 && columns > 0)
+        {
+            arg += 2;
+        }else if (strcmp(argv[arg], "-k") == 0 && arg + 1 < argc)
+        {
+            keysFile = argv[arg + 1];
+            arg += 2;
+        }else
+        {
+            fprintf(stderr, "Usage: %s [-s ROWSxCOLUMNS] [MB...]\n"
+                "       %s [-s ROWSxCOLUMNS] -k KEYS FILE\n", argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool ok = true;
+    printHeader(rows, columns);
+
+    if (keysFile)
+    {
+        if (arg + 1 != argc)
+        {
+            fprintf(stderr, "-k needs exactly one file to replay the keys against\n");
+            return EXIT_FAILURE;
+        }
+
+        struct appendBuffer keys = ABUF_INIT;
+        char buf[ZTEXT_READ_BLOCK];
+        FILE *file = fopen(keysFile, "rb");
+        if (file == NULL)
+        {
+            perror(keysFile);
+            return EXIT_FAILURE;
+        }
+        size_t nRead;
+        while ((nRead = fread(buf, 1, sizeof(buf), file)) > 0) abAppend(&keys, buf, nRead);
+        fclose(file);
+
+        ok = benchWorkloadRun("-", "keys", argv[arg], keys.b, keys.len, rows, columns);
+        abFree(&keys);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    int defaultSizes[] = {1, 16, 128};
+    int numSizes = arg < argc ? argc - arg : 3;
+    for (int i = 0; i < numSizes; i++) {
+        int megabytes = arg < argc ? atoi(argv[arg + i]) : defaultSizes[i];
+        if (megabytes <= 0) continue;
+
+        char *fileName = generateFile(megabytes);
+        char label[32];
+        snprintf(label, sizeof(label), "%d MB", megabytes);
+
+        // Only "save" writes the file back, and it goes last
+        for (int w = 0; w < BENCH_WORKLOADS; w++) {
+            struct appendBuffer keys = ABUF_INIT;
+            workloads[w].script(&keys);
+            ok = benchWorkloadRun(label, workloads[w].name, fileName, keys.b, keys.len, rows, columns) && ok;
+            abFree(&keys);
+        }
+        unlink(fileName);
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
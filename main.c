@@ -15,6 +15,24 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// The AVX2 search loop gets built whatever the target, and used when the CPU has it
+#if defined(__AVX2__) || ((defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__))
+#define ZTEXT_AVX2
+#include <immintrin.h>
+#endif
 
 // CURRENT STEP (TO DO): Step 131 (Beginning of chapter 6)
 
@@ -23,8 +41,49 @@
 #define ZTEXT_VERSION "0.1"
 #define ZTEXT_TAB_STOP 4
 #define ZTEXT_QUIT_TIMES 2
+#define ZTEXT_READ_BLOCK (1 << 20)
+#define ZTEXT_LOAD_FIRST (1 << 20)        // bytes of a file loaded before the first frame, the rest comes in the background
+#define ZTEXT_LOAD_NOTIFY_MS 50
+#define ZTEXT_FOLLOW_MS 16                // appends this close together make one burst
+#define ZTEXT_JOURNAL_OPS 256             // edits the journal holds in memory before it syncs
+#define ZTEXT_JOURNAL_MS 1000             // or how long the oldest of them waits at most
+#define ZTEXT_CHUNK_ROWS 512
+#define ZTEXT_ARENA_BLOCK (1 << 24)
+#define ZTEXT_ROW_MIN_CAPACITY 16
+#define ZTEXT_RENDER_CACHE_SLOTS 256
+#define ZTEXT_ABUF_MIN_CAPACITY 256
+#define ZTEXT_INPUT_BUFFER (1 << 16)
+#define ZTEXT_STATUS_TIMEOUT_MS 5000
+#define ZTEXT_ESCAPE_TIMEOUT_MS 100
+#define ZTEXT_MAX_WATCHES 8
+#define ZTEXT_SAVE_IOV 1024
+#define ZTEXT_PROGRESS_MS 250
+#define ZTEXT_SEARCH_BLOCK (64 << 10)     // most bytes of back to back rows searched in one call
+#define ZTEXT_MAX_WORKERS 16
+#define ZTEXT_TRACE_FRAMES (1 << 14)
+#define ZTEXT_LONG_LINE (1 << 16)         // rows this long only ever render what's on screen
+#define ZTEXT_LINE_CHECKPOINT 4096
+#define ZTEXT_VIEW_ROWS 4096              // lines -R keeps in rows at a time
+#define ZTEXT_VIEW_CHECKPOINT 4096        // lines between two entries of the -R line index
+#define ZTEXT_VIEW_BYTES (16 << 20)
+#define ZTEXT_VIEW_MAP (64 << 20)
+#ifndef ZTEXT_UNDO_BUDGET
+#define ZTEXT_UNDO_BUDGET (64 << 20)   // bytes of undo history kept before the oldest steps go
+#endif
+
+// Row flags
+#define ZTEXT_ROW_ARENA_CHARS 1   // chars lives in the arena and must not be freed on its own
+#define ZTEXT_ROW_TABS 2          // render differs from chars and has to be materialized
+#define ZTEXT_ROW_UTF8 4          // has bytes past ASCII, so bytes and screen columns part ways
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+// Syntax flags
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+// Row end states other than 0 (nothing open) and the quote of an unterminated string
+#define HL_OPEN_COMMENT 1
+
 enum editorKey{
     BACKSPACE = 127,
     ARROW_LEFT = 1000,
@@ -35,18 +94,376 @@ enum editorKey{
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START,
+    PASTE_END
+};
+
+// Stages of a frame, as traced
+enum editorTraceStage{
+    TRACE_READ,
+    TRACE_HANDLE,
+    TRACE_SCROLL,
+    TRACE_DRAW,
+    TRACE_WRITE,
+    TRACE_STAGES
+};
+
+// Batch script commands
+enum editorBatchType{
+    BATCH_GOTO,
+    BATCH_INSERT,
+    BATCH_DELETE,
+    BATCH_REPLACE,
+    BATCH_SAVE
+};
+
+// Undo log entry types
+enum editorUndoType{
+    UNDO_INSERT_CHARS,
+    UNDO_DELETE_CHARS,
+    UNDO_INSERT_ROWS,
+    UNDO_DELETE_ROWS
+};
+
+// Journal entries are the undo types plus this one
+enum editorJournalType{
+    JOURNAL_REPLACE = UNDO_DELETE_ROWS + 1
+};
+
+enum editorHighlight{
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER
 };
 
 // Data
 
 typedef struct{
     int size;
-    int renderSize;
+    int capacity;
+    int renderSlot;
+    unsigned char flags;
+    unsigned char hlOpen;     // what the row leaves open for the next one, see editorHighlightText()
+    unsigned long renderStamp;
     char *chars;
-    char *render;
 } editorRow;
 
+// Rows live in fixed size chunks, so an insert or delete only shifts rows inside one chunk.
+// A chunk can be shared with a snapshot, whoever edits a shared chunk works on a copy of it
+typedef struct{
+    int count;
+    int refs;
+    editorRow rows[ZTEXT_CHUNK_ROWS];
+} editorRowChunk;
+
+// A save running on its own thread, over a frozen copy of the chunk list
+typedef struct{
+    editorRowChunk **chunks;
+    int numChunks;
+    char *fileName;
+    unsigned long version;
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t lock;    // guards everything below
+    long long total;
+    long long written;
+    bool done;
+    int error;
+} editorSaveJob;
+
+// ztext -R, see editorViewOpen()
+typedef struct{
+    bool active;
+    int fd;
+    long long size;
+    char *map;               // the mapped window of the file
+    long long mapStart;
+    long long mapLength;
+    bool mapped;             // map came from mmap, not malloc and pread
+    long pageSize;
+    volatile sig_atomic_t truncated;   // the window ran past the end of a file cut short, see handleViewBus()
+    long long start;         // the rows hold the file's bytes from start to end
+    long long end;
+    long long firstLine;     // line number of the first row, -1 until the index gets that far
+    long long *checkpoints;  // where line k * ZTEXT_VIEW_CHECKPOINT starts, main thread's copy
+    long long numCheckpoints;
+    long long checkpointsCapacity;
+    long long indexed;       // bytes the checkpoints cover
+    long long lines;         // once the index is done
+    bool indexDone;
+    int error;
+    char *query;             // last search, n and N look for it again
+    int direction;
+    pthread_t thread;
+    pthread_mutex_t lock;    // guards everything below
+    long long *pending;
+    long long numPending;
+    long long pendingCapacity;
+    long long pendingIndexed;
+    long long pendingLines;
+    int pendingError;
+    bool pendingDone;
+} editorViewer;
+
+// ztext -f, see editorFollowStart()
+typedef struct{
+    bool active;
+    int fd;                // the file being followed, appended bytes are read from here
+    int inotifyFd;
+    int fileWatch;
+    int dirWatch;          // catches the file getting replaced under its name
+    long long offset;      // bytes of the file the buffer has
+    bool partial;          // the last row is still waiting for its newline
+    long long heldCr;      // offset of a \r at the end kept back for one burst, -1 if none
+    int tailRow;           // cursor put on the last row while a background load went on, -1 if not
+    bool tailEdited;       // the last row changed, or rows went in after it, since the file was read
+    bool stalled;          // not following until a save, see editorFollowCheck()
+} editorFollow;
+
+// A line of a --batch script
+typedef struct{
+    int type;
+    long long line;        // goto: 1-based, a percentage, or LLONG_MAX for the end
+    bool percent;
+    int count;             // delete
+    char *text;            // insert, and what replace looks for
+    int textLength;
+    char *replacement;
+    int replacementLength;
+} editorBatchCommand;
+
+typedef struct{
+    editorBatchCommand *commands;
+    int count;
+    bool streamable;       // see editorBatchStreamable()
+} editorBatchScript;
+
+// Threads that split a job over items (usually chunks) with the main thread. Items are
+// handed out one at a time, so a chunk full of matches doesn't hold everyone else up
+typedef struct{
+    pthread_t threads[ZTEXT_MAX_WORKERS];
+    int numThreads;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    unsigned long generation;  // bumped for every job, that's what wakes the workers
+    void (*task)(int item, void *arg);
+    void *arg;
+    int nextItem;
+    int numItems;
+    int busy;
+} editorWorkerPool;
+
+// Where a query shows up inside one chunk, in row order
+typedef struct{
+    int count;
+    int capacity;
+    int *rows;       // offset of the row in the chunk
+    int *columns;
+} editorMatchList;
+
+typedef struct{
+    const char *query;
+    size_t queryLength;
+    const char *replacement;
+    size_t replacementLength;
+    editorMatchList *matches;  // one list per chunk
+} editorSearchJob;
+
+// A character that isn't one byte on one column: a tab, or anything multibyte. It starts at
+// cx in chars, on column rx and at ro in the render. In between two marks every byte is one
+// column, so the marks are all it takes to go between the three
+typedef struct{
+    int cx;
+    int rx;
+    int ro;
+    unsigned char bytes;        // only tabs are a single byte
+    unsigned char columns;      // 0 for combining marks, 2 for wide characters
+    unsigned char renderBytes;
+} editorColumnMark;
+
+// Where a long row's blocks of about ZTEXT_LINE_CHECKPOINT bytes start, so finding a column
+// never walks more than one of them. `tabs` says whether the block holds a tab
+typedef struct{
+    int cx;
+    int rx;
+    bool tabs;
+} editorLineCheckpoint;
+
+// Tab expanded copies of the rows on screen. A row's copy is valid while the slot
+// still carries the stamp the row was given, so edits and evictions just drop the stamp
+typedef struct{
+    char *render;
+    int size;
+    int capacity;
+    unsigned long stamp;
+    unsigned long lastUsed;
+    unsigned char *hl;     // one highlight per render byte
+    int hlCapacity;
+    int hlStart;           // state the row started in when hl was worked out, -1 if it wasn't
+    editorColumnMark *marks;
+    int numMarks;
+    int marksCapacity;
+    bool windowed;         // a long row's slot, render only covers the window below
+    int windowRx;          // column the render starts on
+    int windowEnd;         // first column past the render, -1 when there's none
+    editorLineCheckpoint *checkpoints;
+    int numCheckpoints;
+    int checkpointsCapacity;
+} editorRenderSlot;
+
+struct editorSyntax{
+    char *fileType;
+    char **fileMatch;
+    char **keywords;         // a trailing '|' marks a type keyword
+    char *singleLineCommentStart;
+    char *multiLineCommentStart;
+    char *multiLineCommentEnd;
+    int flags;
+};
+
+// One primitive edit, or a run of them merged together. Row entries keep their rows joined by '\n'.
+// Entries sharing a group came from the same key and are undone together
+typedef struct{
+    unsigned char type;
+    int y;
+    int x;
+    int rows;
+    char *text;
+    int length;
+    int capacity;
+    unsigned long group;
+} editorUndoOp;
+
+// A file descriptor the event loop polls, with what to run once it turns readable
+typedef struct{
+    int fd;
+    void (*callback)();
+} editorWatch;
+
+enum editorTimerId{
+    STATUS_TIMER,
+    SAVE_TIMER,
+    FOLLOW_TIMER,
+    JOURNAL_TIMER,
+    TIMER_COUNT
+};
+
+// Deadlines are CLOCK_MONOTONIC milliseconds, 0 means the timer is disarmed
+typedef struct{
+    long long deadline;
+    void (*callback)();
+} editorTimer;
+
+// Bump allocated blocks holding the bytes of every row read from disk, freed all at once on close
+typedef struct editorArenaBlock{
+    struct editorArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} editorArenaBlock;
+
+// The rest of a file being read into rows on its own thread. Finished chunks wait in
+// `chunks` until the main loop appends them to the buffer, see editorMergeLoaded()
+typedef struct{
+    bool running;
+    pthread_t thread;
+    char *data;              // the whole file, mapped
+    size_t size;
+    size_t start;            // where the thread picks up
+    size_t loaded;           // bytes merged into the buffer so far, main thread only
+    editorArenaBlock *arena; // the loaded rows' bytes, handed to the buffer's arena at the end
+    pthread_mutex_t lock;    // guards everything below
+    editorRowChunk **chunks;
+    int numChunks;
+    int chunksCapacity;
+    int numRows;
+    size_t parsed;
+    bool done;
+    bool cancel;
+    int error;               // why the thread gave up early, the main loop reports it
+} editorLoadJob;
+
+struct appendBuffer
+{
+    char *b;
+    int len;
+    int capacity;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+// Where one frame's time went, in ns on the monotonic clock
+typedef struct{
+    long long start;       // first key of the frame, or the redraw if there wasn't one
+    long long refresh;     // redraw started
+    long long stages[TRACE_STAGES];
+    int keys;
+    long bytes;
+    long allocations;
+} editorTraceFrame;
+
+typedef struct{
+    bool enabled;
+    bool hud;              // last frame's numbers in the status bar
+    char *fileName;        // --trace, written at exit
+    editorTraceFrame *frames;
+    long long count;       // frames so far, the ring keeps the last ZTEXT_TRACE_FRAMES
+    editorTraceFrame current;
+} editorTrace;
+
+// A streamable batch script on its way through one file, see editorBatchStreamRows()
+typedef struct{
+    editorBatchScript *script;
+    const char *data;
+    size_t length;
+    int fd;
+    bool failed;
+    struct appendBuffer out;
+    struct appendBuffer scratch[2];    // rows between one replace and the next
+} editorBatchStream;
+
+// Starts every journal, says which file its entries apply to and who's writing them
+typedef struct{
+    char magic[8];
+    long long size;
+    long long mtimeSec;
+    long long mtimeNsec;
+    long long device;
+    long long inode;
+    int pid;
+} editorJournalHeader;
+
+// Followed by length bytes of text
+typedef struct{
+    unsigned int check;    // of everything after it, a write torn by a crash doesn't match
+    int type;
+    int y;
+    int x;                 // for rows, how many, joined by '\n'. For JOURNAL_REPLACE, how much of the text is the query
+    int length;
+} editorJournalEntry;
+
+// Crash recovery, see editorJournalRecord()
+typedef struct{
+    bool enabled;          // interactive sessions only, --batch and -R have nothing to lose
+    bool suspended;        // a journal being replayed, or replace-all logging its rows for undo
+    int fd;                // -1 until the first edit since the file was last saved
+    char *path;
+    long long length;      // bytes in the journal file
+    long long saveMark;    // where it stood when the running save took its snapshot
+    struct appendBuffer pending;   // entries not written yet
+    int pendingOps;
+    bool runOpen;          // the last pending entry is rows still taking more, its check isn't done
+    long long runEntry;    // where in pending it starts
+    editorJournalHeader header;
+} editorJournal;
+
 struct config
 {
     int cx, cy;
@@ -58,21 +475,88 @@ struct config
     int terminalColumns;
     int numRows;
     char *fileName;
+    long long fileSize;    // bytes editorOpen() read, and of which file
+    dev_t fileDevice;
+    ino_t fileInode;
     char statusMsg[80];
-    time_t statusMsg_time;
-    editorRow *row;
+    long long statusMsg_time;
+    editorRowChunk **chunks;
+    int *chunkIndex;
+    int numChunks;
+    int chunkCapacity;
+    editorArenaBlock *arena;
+    editorRenderSlot renderCache[ZTEXT_RENDER_CACHE_SLOTS];
+    unsigned long renderStamp;
+    unsigned long renderClock;
+    struct appendBuffer *screen;   // what the terminal shows right now, one entry per line
+    int screenLines;
+    bool screenValid;
+    int screenCursorRow;
+    int screenCursorColumn;
+    long frameBytes;
+    long totalBytes;
+    long frames;
+    struct appendBuffer frame;     // reused every refresh, only ever grows
+    struct appendBuffer frameLine;
+    long allocations;
+    long frameAllocations;
+    char input[ZTEXT_INPUT_BUFFER];   // raw bytes read from the terminal, decoded into keys on demand
+    int inputStart;
+    int inputLength;
+    editorWatch watches[ZTEXT_MAX_WATCHES];
+    int numWatches;
+    editorTimer timers[TIMER_COUNT];
+    int signalPipe[2];
+    int workerPipe[2];     // background threads poke this when they have news for the main loop
+    editorSaveJob save;
+    editorLoadJob load;
+    editorViewer view;
+    editorFollow follow;
+    editorJournal journal;
+    editorWorkerPool pool;
+    struct editorSyntax *syntax;
+    int hlFrontier;        // rows above this one have an up to date hlOpen
+    editorUndoOp *undoOps;
+    int undoCount;
+    int undoCapacity;
+    int undoCursor;        // entries below this have been applied, the ones above can be redone
+    long long undoBytes;
+    long long undoBudget;
+    unsigned long undoGroup;
+    unsigned long undoSkipGroup;
+    bool undoReplaying;
+    unsigned long version; // bumped on every edit
     bool stinky;
+    bool batch;            // running --batch, there's no terminal to clean up after
+    int poolCores;         // cores the worker pool may use, 0 for every one there is
+    editorTrace trace;
 };
 
 struct config editor;
 
-struct appendBuffer
-{
-    char *b;
-    int len;
+// Highlight database
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "do", "goto", "sizeof", "const", "extern", "volatile", "inline",
+
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "bool|", "size_t|", NULL
+};
+
+struct editorSyntax HLDB[] = {
+    {
+        "c",
+        C_HL_extensions,
+        C_HL_keywords,
+        "//", "/*", "*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    },
 };
 
-#define ABUF_INIT {NULL, 0}
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 // Function prototyping
 
@@ -80,736 +564,5853 @@ void enableRawInput();
 void disableRawInput();
 void printEditorError(const char *s);
 int readKey();
+bool readInputByte(char *c, int timeout);
+bool fillInput(int timeout);
+void initializeEventLoop();
+void waitForEvents();
+void watchFd(int fd, void (*callback)());
+void unwatchFd(int fd);
+void setTimer(int id, long long deadline, void (*callback)());
+long long monotonicMs();
+void handleSignals();
+void handleWindowChange(int signal);
+bool inputPending();
 void processInputs();
+void processKey(int c);
+void editorPaste();
+void editorInsertText(const char *s, size_t len);
 void refreshScreen();
-void drawRows();
+void drawRows(struct appendBuffer *ab, struct appendBuffer *line);
+void drawRow(struct appendBuffer *line, int i);
+void drawMessageBar(struct appendBuffer *ab);
+bool emitLine(struct appendBuffer *ab, int y, struct appendBuffer *line);
+bool isPlainLine(struct appendBuffer *line);
+void abAppend(struct appendBuffer *ab, const char *s, int len);
+void abPad(struct appendBuffer *ab, char c, int count);
+bool abReserve(struct appendBuffer *ab, int needed);
+void abFree(struct appendBuffer *ab);
+int writeAll(int fd, const char *buf, int len);
+long long preadAll(int fd, char *buf, long long length, long long offset);
+void resizeScreen();
 int getWindowSize(int *rows, int *columns);
 void initializeEditor();
+void initializeEditorSized(int rows, int columns);
 int getCursorPos(int *rows, int *columns);
 void moveCursor(int c);
+void editorGotoLine();
+bool editorPromptLine(long long *value, bool *percent);
+void editorJumpToRow(int at);
 void editorOpen(char* fileName);
-void editorInsertRow(int at, char *s, size_t len);
+void editorCloseFile();
+char* editorArenaAlloc(size_t size);
+char* editorArenaAllocIn(editorArenaBlock **arena, size_t size);
+void editorArenaFree();
+void editorRowReserve(editorRow *row, int needed);
+int editorRenderLength(editorRow *row);
+int editorFillRender(editorRow *row, editorRenderSlot *slot, int from, int rx, int last);
+char* editorRowRender(editorRow *row, int *length);
+editorRenderSlot* editorRowSlot(editorRow *row, bool *fresh);
+void editorRenderReserve(editorRenderSlot *slot, int needed);
+char* editorRowWindow(editorRow *row, int *length);
+int editorCharColumns(editorRow *row, int cx, int rx, int *columns);
+void editorBuildCheckpoints(editorRow *row, editorRenderSlot *slot);
+void editorAddCheckpoint(editorRenderSlot *slot, int at, int cx, int rx);
+int editorLastCheckpoint(editorRenderSlot *slot, int value, bool byColumn);
+editorRenderSlot* editorRowCheckpoints(editorRow *row);
+void editorPatchCheckpoints(editorRow *row, int at, int removed, int added);
+void editorRowChanged(editorRow *row, int at, int removed, int added);
+void editorLoadBuffer(const char *data, size_t len);
+const char* editorLoadRow(editorRow *row, const char *p, const char *end, editorArenaBlock **arena);
+void editorStartLoad(char *data, size_t size, size_t start);
+void *editorLoadThread(void *arg);
+void *editorLoadFailed(editorLoadJob *job, editorRowChunk *chunk);
+bool editorLoadPublish(editorLoadJob *job, editorRowChunk *chunk);
+void editorMergeLoaded();
+void editorFinishLoad();
+void editorFinishLoadAtEnd();
+void editorCancelLoad();
+void editorEndLoad();
+size_t editorCountNewlines(const char *data, size_t len);
+void editorInsertRow(int at, const char *s, size_t len);
+editorRow* editorRowAt(int at);
+editorRow* editorOpenRowSlot(int at);
+int editorFindChunk(int at, int *offset);
+void editorChunkIndexAdd(int chunk, int delta);
+void editorRebuildChunkIndex();
+void editorGrowChunks(int needed);
+editorRowChunk* editorInsertChunk(int index);
+void editorRemoveChunk(int index);
 void editorScroll();
 void editorUpdateRow(editorRow *row);
 int editorRowCxToRx(editorRow *row, int cx);
+int editorRowRxToCx(editorRow *row, int rx);
+editorRenderSlot* editorRowMarks(editorRow *row);
+int editorLastMark(editorRenderSlot *slot, int value, bool byColumn);
+int editorRowNextChar(editorRow *row, int cx);
+int editorRowPrevChar(editorRow *row, int cx);
+int editorRenderOffset(editorRenderSlot *slot, int rx, bool after, int *pad);
+int editorVisibleRender(editorRow *row, int renderSize, int *from, int *padLeft, int *padRight);
+int editorScanText(const char *s, size_t len);
+const char* editorScanLine(const char *s, const char *end, int *flags);
+int editorDecodeChar(const char *s, int length, unsigned int *codepoint);
+int editorCharWidth(unsigned int codepoint);
 void drawStatusBar(struct appendBuffer *ab);
 void setStatusMessage(const char *fmt, ...);
-void editorRowInsertChar(editorRow *row, int at, int c);
+void editorRowInsertChar(int y, int at, int c);
+void editorRowInsertString(int y, int at, const char *s, size_t len);
+void editorRowAppendString(int y, const char *s, size_t len);
+void editorRowDelChar(int y, int at);
+void editorRowDelChars(int y, int at, int len);
+void editorDelRows(int at, int count);
+void editorUndoRecord(int type, int y, int x, const char *s, int len);
+void editorUndoAppend(editorUndoOp *op, const char *s, int len, bool front);
+void editorUndoTrim();
+void editorUndoDropRedo();
+void editorUndoClear();
+void editorUndoApply(editorUndoOp *op, bool undo);
+void editorUndo();
+void editorRedo();
 void editorInsertChar(int c);
-char* editorRowsToString(int* bufLength);
+int editorWriteFile(const char *fileName, editorSaveJob *job);
+int editorReplaceFile(const char *fileName, int (*writeContents)(int fd, void *arg), void *arg);
+int editorWriteRows(int fd, void *arg);
+void editorStartSave();
+void *editorSaveThread(void *arg);
+void editorFinishSave();
+void editorShowSaveProgress();
+void handleWorkers();
+void notifyMainLoop();
+void editorReleaseChunks(editorRowChunk **chunks, int numChunks);
+editorRowChunk* editorChunkForEdit(int c);
+editorRow* editorRowForEdit(int at);
+int writevAll(int fd, struct iovec *iov, int count);
 void editorFreeRow(editorRow *row);
 void editorDelRow(int at);
-char* editorPrompt(char *prompt);
+char* editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorFind();
+void editorFindCallback(char *query, int key);
+int editorSearchRows(const char *query, size_t queryLength, int from, int direction, int *column);
+int editorSearchChunk(editorRowChunk *chunk, int offset, const char *query, size_t queryLength, int *column);
+const char* editorMemSearch(const char *haystack, size_t length, const char *needle, size_t needleLength);
+bool editorMemEqual(const char *a, const char *b, size_t length);
+#ifdef ZTEXT_AVX2
+const char* editorMemSearchAvx2(const char *haystack, size_t positions, const char *needle, size_t needleLength, size_t *at);
+#endif
+void editorFindAll();
+void editorUndoRecordReplace(editorSearchJob *job, int type);
+void editorReplaceAll();
+int editorReplaceText(const char *query, const char *replacement, int *rows);
+int editorCollectMatches(editorSearchJob *job, int *rows);
+void editorFreeMatches(editorSearchJob *job);
+void editorMatchChunk(int c, void *arg);
+void editorReplaceChunk(int c, void *arg);
+void editorRunParallel(void (*task)(int item, void *arg), void *arg, int numItems);
+void *editorPoolThread(void *arg);
+void editorPoolWork();
+void editorSelectSyntaxHighlight();
+unsigned char editorHighlightText(const char *text, int length, unsigned char state, unsigned char *hl);
+unsigned char editorHighlightRow(editorRow *row, unsigned char state);
+unsigned char editorHighlightStart(int at);
+void editorHighlightChanged(int at);
+unsigned char* editorRowHighlight(int at, char **render, int *length);
+int editorSyntaxToColor(int hl);
+bool isSeparator(int c);
+void editorTraceStart(const char *fileName);
+long long editorTraceClock();
+void editorTraceKey(long long start, long long decoded, long long end);
+void editorTraceFrameDone(long long start, long long scrolled, long long drawn, long long end);
+void editorTraceToggleHud();
+editorTraceFrame* editorTraceLast();
+void editorTraceDump();
+int editorBatch(int argc, char *argv[]);
+bool editorBatchParse(const char *fileName, editorBatchScript *script);
+bool editorBatchUnescape(char *s, char delimiter, char **end, int *length);
+bool editorBatchStreamable(editorBatchScript *script);
+int editorBatchFile(editorBatchScript *script, char *fileName);
+int editorBatchEdit(editorBatchScript *script, char *fileName);
+int editorBatchStreamRows(int fd, void *arg);
+const char* editorBatchNextLine(const char *p, const char *end, int *length);
+void editorBatchEmit(editorBatchStream *stream, const char *s, int length, int first);
+void editorViewOpen(char *fileName);
+const char* editorViewMap(long long from, long long to);
+void editorViewUnmap();
+void editorViewCheckSize();
+void handleViewBus(int signal, siginfo_t *info, void *context);
+long long editorViewSkip(long long offset, long long n, long long budget, long long *moved);
+long long editorViewLineStart(long long offset);
+long long editorViewLineAt(long long offset);
+long long editorViewLineOffset(long long line);
+void editorViewShow(long long offset, long long line, int screenRow, int cx);
+void editorViewFollow();
+int editorViewKey(int c);
+void editorViewGotoLine();
+void editorViewFind(int direction);
+bool editorViewFindCancelled(long long searched, long long *lastShown);
+void *editorViewIndexThread(void *arg);
+void editorViewPublish(editorViewer *view, long long offset);
+void editorViewMergeIndex();
+void editorFollowStart();
+void editorFollowAttach();
+void editorFollowEvents();
+void editorFollowCheck();
+void editorFollowRead(long long size);
+void editorFollowReload(const char *message);
+void editorFollowTail();
+void editorFollowSaved(long long written);
+void editorFollowEdited(int y);
+char* editorJournalPath(const char *fileName);
+void editorJournalStart();
+void editorJournalRecover();
+bool editorJournalApply(editorJournalEntry *entry, const char *s);
+unsigned int editorJournalChecksum(editorJournalEntry *entry, const char *s);
+void editorJournalStat(editorJournalHeader *header);
+void editorJournalIdentify();
+void editorJournalRecord(int type, int y, int x, const char *s, int len);
+void editorJournalCloseRun();
+void editorJournalReplace(const char *query, const char *replacement);
+void editorJournalFlush();
+void editorJournalSaving();
+void editorJournalSaved(bool clean);
+void editorJournalDiscard();
+void handleHangup(int signal);
 
 // Main function (entry point)
 
+#ifndef ZTEXT_NO_MAIN
 int main(int argc, char *argv[]){
 
+    if(argc >= 2 && strcmp(argv[1], "--batch") == 0){
+        return editorBatch(argc - 2, argv + 2);
+    }
+
+    char *traceFile = NULL;
+    bool viewer = false;
+    bool follow = false;
+    int arg = 1;
+    while(arg < argc && argv[arg][0] == '-'){
+        if(strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc){
+            traceFile = argv[arg + 1];
+            arg += 2;
+        }else if(strcmp(argv[arg], "-R") == 0){
+            viewer = true;
+            arg++;
+        }else if(strcmp(argv[arg], "-f") == 0){
+            follow = true;
+            arg++;
+        }else{
+            break;
+        }
+    }
+    if((arg < argc && argv[arg][0] == '-') || ((viewer || follow) && arg + 1 != argc) || (viewer && follow)){
+        fprintf(stderr, "Usage: ztext [--trace FILE.json] [FILE]\n"
+            "       ztext [--trace FILE.json] -f FILE\n"
+            "       ztext [--trace FILE.json] -R FILE\n"
+            "       ztext --batch SCRIPT FILE...\n");
+        return EXIT_FAILURE;
+    }
+
     enableRawInput();
     initializeEditor();
-    if(argc >= 2){
-        editorOpen(argv[1]);
+    if(traceFile){
+        editorTraceStart(traceFile);
+    }
+    if(viewer){
+        editorViewOpen(argv[arg]);
+    }else if(arg < argc){
+        editorOpen(argv[arg]);
+        if(follow){
+            editorFollowStart();
+        }
+    }
+    if(!viewer){
+        editorJournalStart();
     }
 
     // Infinite loop. Custom functions will call for the program to exit
     while(1){
         refreshScreen();
-        processInputs();
+        waitForEvents();
     }
 
     return EXIT_SUCCESS;
 }
+#endif
 
 // User defined functions
 
 // Initialization
 
 void initializeEditor(){
+    int rows, columns;
+    if(getWindowSize(&rows, &columns) == -1){
+        printEditorError("Window size error");
+    }
+
+    initializeEditorSized(rows, columns);
+}
+
+// Everything but asking the terminal how big it is, so headless runs can make a size up
+void initializeEditorSized(int rows, int columns){
     editor.cx = 0;
     editor.cy = 0;
     editor.rx = 0;
     editor.rowOffset = 0;
     editor.columnOffset = 0;
     editor.numRows = 0;
-    editor.row = NULL;
+    editor.chunks = NULL;
+    editor.chunkIndex = NULL;
+    editor.numChunks = 0;
+    editor.chunkCapacity = 0;
+    editor.arena = NULL;
+    memset(editor.renderCache, 0, sizeof(editor.renderCache));
+    for (int i = 0; i < ZTEXT_RENDER_CACHE_SLOTS; i++) editor.renderCache[i].hlStart = -1;
+    editor.syntax = NULL;
+    editor.hlFrontier = 0;
+    editor.undoOps = NULL;
+    editor.undoCount = 0;
+    editor.undoCapacity = 0;
+    editor.undoCursor = 0;
+    editor.undoBytes = 0;
+    editor.undoBudget = ZTEXT_UNDO_BUDGET;
+    editor.undoGroup = 1;
+    editor.undoSkipGroup = 0;
+    editor.undoReplaying = false;
+    editor.renderStamp = 0;
+    editor.renderClock = 0;
+    editor.screen = NULL;
+    editor.screenLines = 0;
+    editor.screenValid = false;
+    editor.screenCursorRow = 0;
+    editor.screenCursorColumn = 0;
+    editor.frameBytes = 0;
+    editor.totalBytes = 0;
+    editor.frames = 0;
+    editor.frame = (struct appendBuffer) ABUF_INIT;
+    editor.frameLine = (struct appendBuffer) ABUF_INIT;
+    editor.allocations = 0;
+    editor.frameAllocations = 0;
+    editor.inputStart = 0;
+    editor.inputLength = 0;
     editor.fileName = NULL;
     editor.statusMsg[0] = '\0';
     editor.statusMsg_time = 0;
+    editor.numWatches = 0;
+    memset(editor.timers, 0, sizeof(editor.timers));
+    memset(&editor.save, 0, sizeof(editor.save));
+    pthread_mutex_init(&editor.save.lock, NULL);
+    memset(&editor.load, 0, sizeof(editor.load));
+    pthread_mutex_init(&editor.load.lock, NULL);
+    memset(&editor.view, 0, sizeof(editor.view));
+    pthread_mutex_init(&editor.view.lock, NULL);
+    memset(&editor.follow, 0, sizeof(editor.follow));
+    memset(&editor.journal, 0, sizeof(editor.journal));
+    editor.journal.fd = -1;
+    editor.journal.pending = (struct appendBuffer) ABUF_INIT;
+    editor.fileSize = 0;
+    memset(&editor.pool, 0, sizeof(editor.pool));
+    editor.version = 0;
     editor.stinky = false;
+    memset(&editor.trace, 0, sizeof(editor.trace));
 
-    if(getWindowSize(&editor.terminalRows, &editor.terminalColumns) == -1){
-        printEditorError("Window size error");
-    }
-
-    editor.terminalRows -= 2;
-    setStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit");
+    editor.terminalRows = rows - 2;
+    editor.terminalColumns = columns;
+    initializeEventLoop();
+    setStatusMessage("HELP: Ctrl-S save | Ctrl-Q quit | Ctrl-F find | Ctrl-G go to | Ctrl-A count | Ctrl-R replace");
 }
 
 // File input/output functions
 
 void editorOpen(char* fileName){
+    editorCloseFile();
     free(editor.fileName);
     editor.fileName = strdup(fileName);
+    editorSelectSyntaxHighlight();
 
-    FILE *fp = fopen(fileName, "r");
-    if (!fp) printEditorError("Cannot open file");
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) printEditorError("Cannot open file");
 
-    char *line = NULL;
-    size_t lineCap = 0;
-    ssize_t lineLength;
+    struct stat st;
+    if (fstat(fd, &st) == -1) printEditorError("Cannot stat file");
+    editor.fileDevice = st.st_dev;
+    editor.fileInode = st.st_ino;
+    editor.fileSize = st.st_size;
 
-    while((lineLength = getline(&line, &lineCap, fp)) != -1)
+    // Regular files get mapped whole, anything else (pipes, ttys...) is slurped in big blocks
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
     {
-        while(lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r'))
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
         {
-            lineLength--;
-        }
-        editorInsertRow(editor.numRows, line, lineLength);
-    }
-    free(line);
-    fclose(fp);
-    editor.stinky = false;
-}
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            editor.stinky = false;
 
-char* editorRowsToString(int* bufLength) {
-    int totalLength = 0;
-    int i;
-    for (i = 0; i < editor.numRows; i++) {
-        totalLength += editor.row[i].size + 1;
-    }
-    *bufLength = totalLength;
+            // Enough for the first screen now, up to the end of a line, and the rest on a thread
+            size_t size = st.st_size;
+            char *split = NULL;
+            if (size > ZTEXT_LOAD_FIRST && !editor.batch) split = memchr(data + ZTEXT_LOAD_FIRST, '\n', size - ZTEXT_LOAD_FIRST);
+            if (split && (size_t)(split + 1 - data) < size)
+            {
+                editorLoadBuffer(data, split + 1 - data);
+                editorStartLoad(data, size, split + 1 - data);
+                return;
+            }
 
-    char *buffer = malloc(totalLength);
-    char *p = buffer;
-    for (i = 0; i < editor.numRows; i++) {
-        memcpy(p, editor.row[i].chars, editor.row[i].size);
-        p += editor.row[i].size;
-        *p = '\n';
-        p++;
+            editorLoadBuffer(data, size);
+            munmap(data, size);
+            return;
+        }
     }
 
-    return buffer;
-}
+    size_t cap = ZTEXT_READ_BLOCK;
+    size_t len = 0;
+    char *data = malloc(cap);
+    ssize_t nRead;
 
-void editorSaveFile() {
-    if (editor.fileName == NULL)
+    while ((nRead = read(fd, data + len, cap - len)) != 0)
     {
-        editor.fileName = editorPrompt("Save file as: %s (Press ESC to cancel)");
-        if (editor.fileName == NULL)
+        if (nRead == -1)
         {
-            setStatusMessage("Saving sequence aborted");
-            return;
+            if (errno == EINTR) continue;
+            printEditorError("Cannot read file");
+        }
+        len += nRead;
+        if (len == cap)
+        {
+            cap *= 2;
+            data = realloc(data, cap);
+            if (data == NULL) printEditorError("Cannot allocate file buffer");
         }
     }
+    editorLoadBuffer(data, len);
+    editor.fileSize = len;
+    free(data);
+    close(fd);
+    editor.stinky = false;
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
-    int fd = open(editor.fileName, O_RDWR | O_CREAT, 0644);
-    if (fd != -1)
+size_t editorCountNewlines(const char *data, size_t len){
+    size_t count = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16)
     {
-        if (ftruncate(fd, len) != -1)
-        {
-            if (write(fd, buf, len) == len)
-            {
-                close(fd);
-                free(buf);
-                editor.stinky = false;
-                setStatusMessage("Saving successful. %d bytes written on disk.", len);
-                return;
-            }
-        }
-        close(fd);
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
     }
+#endif
+    for (; i < len; i++) if (data[i] == '\n') count++;
 
-    free(buf);
-    setStatusMessage("File saving aborted. I/O Error: %s", strerror(errno));
+    return count;
 }
 
-// Terminal functions
+void editorLoadBuffer(const char *data, size_t len){
+    if (len == 0) return;
 
-int readKey(){
+    // Size the chunk list once so the loop below never reallocs it
+    size_t lines = editorCountNewlines(data, len);
+    if (data[len - 1] != '\n') lines++;
 
-    int nRead;
-    char c;
+    editorGrowChunks(editor.numChunks + lines / ZTEXT_CHUNK_ROWS + 1);
 
-    while((nRead = read(STDIN_FILENO, &c, 1)) != 1)
+    const char *p = data;
+    const char *end = data + len;
+
+    while (p < end)
     {
-        if(nRead == -1 && errno != EAGAIN)
+        editorRowChunk *chunk = editor.numChunks ? editorChunkForEdit(editor.numChunks - 1) : NULL;
+        if (chunk == NULL || chunk->count == ZTEXT_CHUNK_ROWS)
         {
-            perror("Key reading error");
+            chunk = editorInsertChunk(editor.numChunks);
         }
-    }
 
-    if(c == '\x1b')
-    {
-        char sequence[3];
+        p = editorLoadRow(&chunk->rows[chunk->count++], p, end, &editor.arena);
+        if (p == NULL) printEditorError("Cannot allocate rows");
+        editor.numRows++;
+    }
 
-        if(read(STDIN_FILENO, &sequence[0], 1) != 1) return '\x1b';
-        if(read(STDIN_FILENO, &sequence[1], 1) != 1) return '\x1b';
+    editorRebuildChunkIndex();
+}
 
-        if(sequence[0] == '[')
-        {
-            if(sequence[1] >= '0' && sequence[1] <= '9')
-            {
-                if (read(STDIN_FILENO, &sequence[2], 1) != 1) return '\x1b';
-                if (sequence[2] == '~')
-                {
-                    switch (sequence[1])
-                    {
-                        case '1':
-                            return HOME_KEY;
-                        case '3':
-                            return DELETE_KEY;
-                        case '4':
-                            return END_KEY;
-                        case '7':
-                            return HOME_KEY;
-                        case '8':
-                            return END_KEY;
-                        case '5':
-                            return PAGE_UP;
-                        case '6':
-                            return PAGE_DOWN;
-                    }
-                }
-            }else
-            {
-                switch (sequence[1])
-                {
-                    case 'A':
-                        return ARROW_UP;
-                    case 'B':
-                        return ARROW_DOWN;
-                    case 'C':
-                        return ARROW_RIGHT;
-                    case 'D':
-                        return ARROW_LEFT;
-                    case 'H':
-                        return HOME_KEY;
-                    case 'F':
-                        return END_KEY;
-                }
-            }
-        }
-        return '\x1b';
-    }
+// Fills row with the line starting at p, its bytes going into arena. Returns where the next
+// line starts, or NULL when there's no memory for this one
+const char* editorLoadRow(editorRow *row, const char *p, const char *end, editorArenaBlock **arena){
+    int flags;
+    const char *newline = editorScanLine(p, end, &flags);
+    size_t lineLength = (newline ? newline : end) - p;
 
-    return c;
+    while (lineLength > 0 && p[lineLength - 1] == '\r') lineLength--;
 
-}
+    row->size = lineLength;
+    row->capacity = lineLength + 1;
+    row->flags = ZTEXT_ROW_ARENA_CHARS;
+    row->flags |= flags;
+    row->renderSlot = 0;
+    row->renderStamp = 0;
 
-void enableRawInput(){
+    // Render stays unbuilt until the row actually shows up on screen
+    row->chars = editorArenaAllocIn(arena, lineLength + 1);
+    if (row->chars == NULL) return NULL;
+    memcpy(row->chars, p, lineLength);
+    row->chars[lineLength] = '\0';
 
-    if(tcgetattr(STDIN_FILENO, &editor.og_termios) == -1){
-        printEditorError("Get terminal attributes upon enabling raw mode error");
-    }
-    atexit(disableRawInput);
+    return newline ? newline + 1 : end;
+}
 
-    struct termios raw = editor.og_termios;
+// Reads data from start on into rows on a thread of its own, the buffer gets them a batch
+// at a time through handleWorkers(). Until then the rows above can be viewed and edited as usual
+void editorStartLoad(char *data, size_t size, size_t start){
+    editorLoadJob *job = &editor.load;
 
-    // Disabling all possible flags bitwise
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);    
-    raw.c_oflag &= ~(OPOST);
-    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
-    raw.c_cflag |= (CS8);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 10;
+    job->data = data;
+    job->size = size;
+    job->start = start;
+    job->loaded = start;
+    job->arena = NULL;
+    job->numChunks = 0;
+    job->numRows = 0;
+    job->parsed = start;
+    job->done = false;
+    job->cancel = false;
+    job->error = 0;
+    job->running = true;
 
-    if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1){
-        printEditorError("Set terminal attributes upon enabling raw mode error");
+    if (pthread_create(&job->thread, NULL, editorLoadThread, job) != 0)
+    {
+        // No thread to be had, load it all right here instead
+        editorLoadThread(job);
+        job->thread = pthread_self();
+        editorFinishLoad();
     }
 }
 
-void disableRawInput(){
-    // If this messes up, we're in deep shit
-    if(tcsetattr(STDERR_FILENO, TCSAFLUSH, &editor.og_termios) == -1)
+void *editorLoadThread(void *arg){
+    editorLoadJob *job = arg;
+    const char *p = job->data + job->start;
+    const char *end = job->data + job->size;
+    long long lastNotify = monotonicMs();
+
+    while (p < end)
     {
-        printEditorError("Set terminal attributes upon disabling raw mode error");
+        // Out of memory is for the main thread to deal with, it's the one that owns the terminal
+        editorRowChunk *chunk = malloc(sizeof(editorRowChunk));
+        if (chunk == NULL) return editorLoadFailed(job, NULL);
+        chunk->count = 0;
+        chunk->refs = 1;
+        while (p < end && chunk->count < ZTEXT_CHUNK_ROWS) {
+            p = editorLoadRow(&chunk->rows[chunk->count++], p, end, &job->arena);
+            if (p == NULL) return editorLoadFailed(job, chunk);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        bool published = editorLoadPublish(job, chunk);
+        if (published) job->parsed = p - job->data;
+        bool cancel = job->cancel;
+        pthread_mutex_unlock(&job->lock);
+        if (!published) return editorLoadFailed(job, chunk);
+        if (cancel) return NULL;
+
+        if (monotonicMs() - lastNotify >= ZTEXT_LOAD_NOTIFY_MS)
+        {
+            notifyMainLoop();
+            lastNotify = monotonicMs();
+        }
     }
+
+    pthread_mutex_lock(&job->lock);
+    job->done = true;
+    pthread_mutex_unlock(&job->lock);
+
+    notifyMainLoop();
+    return NULL;
 }
 
-void printEditorError(const char *s){
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+// Ends the loader thread on an allocation failure, handleWorkers() takes it from there
+void *editorLoadFailed(editorLoadJob *job, editorRowChunk *chunk){
+    free(chunk);
 
-    // *pain.jpg*
-    perror(s);
-    exit(EXIT_FAILURE);
+    pthread_mutex_lock(&job->lock);
+    job->error = ENOMEM;
+    job->done = true;
+    pthread_mutex_unlock(&job->lock);
+
+    notifyMainLoop();
+    return NULL;
 }
 
-int getWindowSize(int *rows, int *columns){
-    struct winsize windowSize;
-    
-    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &windowSize) == -1 || windowSize.ws_col == 0)
-    {
-        if(write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12){
-            return -1;
-        }
-        return getCursorPos(rows, columns);
-    }else
+// Queues a finished chunk for the main thread. Called with the lock held, false if there's no room
+bool editorLoadPublish(editorLoadJob *job, editorRowChunk *chunk){
+    if (job->numChunks == job->chunksCapacity)
     {
-        *rows = windowSize.ws_row;
-        *columns = windowSize.ws_col;
-        return 0;
+        int capacity = job->chunksCapacity ? job->chunksCapacity * 2 : 64;
+        editorRowChunk **chunks = realloc(job->chunks, sizeof(editorRowChunk *) * capacity);
+        if (chunks == NULL) return false;
+        job->chunks = chunks;
+        job->chunksCapacity = capacity;
     }
+    job->chunks[job->numChunks++] = chunk;
+    job->numRows += chunk->count;
+    return true;
 }
 
-int getCursorPos(int *rows, int *columns){
+// Appends whatever the loader has finished to the end of the buffer. The loaded rows always
+// follow the rows before them in the file, so edits made in the meantime stay where they were
+void editorMergeLoaded(){
+    editorLoadJob *job = &editor.load;
+    if (!job->running) return;
 
-    char buf[32];
-    unsigned int i = 0;
+    pthread_mutex_lock(&job->lock);
+    editorGrowChunks(editor.numChunks + job->numChunks);
+    if (job->numChunks) memcpy(&editor.chunks[editor.numChunks], job->chunks, sizeof(editorRowChunk *) * job->numChunks);
+    int numChunks = job->numChunks;
+    editor.numChunks += job->numChunks;
+    editor.numRows += job->numRows;
+    job->numChunks = 0;
+    job->numRows = 0;
+    job->loaded = job->parsed;
+    bool done = job->done;
+    int error = job->error;
+    pthread_mutex_unlock(&job->lock);
 
-    if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+    if (error)
+    {
+        errno = error;
+        printEditorError("Cannot allocate rows");
+    }
 
-    while (i < sizeof(buf) - 1)
+    if (numChunks) editorRebuildChunkIndex();
+    if (done)
     {
-        if(read(STDIN_FILENO, &buf[i], 1) != 1) break;
-        if(buf[i] == 'R') break;
-        i++;
+        editorEndLoad();
+        editorFollowCheck();
     }
-    buf[i] = '\0';
+}
 
-    if(buf[0] != '\x1b' || buf[1] != '[') return -1;
-    if(sscanf(&buf[2], "%d;%d", rows, columns) != 2) return -1;
+// Waits for the loader to read the rest of the file, for whatever needs all of it (saving, replacing...)
+void editorFinishLoad(){
+    editorLoadJob *job = &editor.load;
+    if (!job->running) return;
 
-    return 0;
+    if (!pthread_equal(job->thread, pthread_self())) pthread_join(job->thread, NULL);
+    job->done = true;
+    editorMergeLoaded();
 }
 
-// Row operation functions
+// Stops the loader and throws away what it read
+void editorCancelLoad(){
+    editorLoadJob *job = &editor.load;
+    if (!job->running) return;
 
-int editorRowCxToRx(editorRow *row, int cx){
-    int rx = 0;
+    pthread_mutex_lock(&job->lock);
+    job->cancel = true;
+    pthread_mutex_unlock(&job->lock);
+    if (!pthread_equal(job->thread, pthread_self())) pthread_join(job->thread, NULL);
 
-    for (int i = 0; i < cx; i++) {
-        if(row->chars[i] == '\t')
-        {
-            rx += (ZTEXT_TAB_STOP - 1) - (rx % ZTEXT_TAB_STOP);
-        }
-        rx++;
-    }
-    return rx;
+    editorReleaseChunks(job->chunks, job->numChunks);
+    job->numChunks = 0;
+    job->numRows = 0;
+    editorEndLoad();
 }
 
-void editorUpdateRow(editorRow *row) {
-    int tabs = 0;
-    int i;
-
-    for (i = 0; i < row->size; i++) if (row->chars[i] == '\t') tabs++;
+// The loaded rows keep their bytes in the job's arena, so it outlives the job as part of the buffer's
+void editorEndLoad(){
+    editorLoadJob *job = &editor.load;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(ZTEXT_TAB_STOP - 1) + 1);
+    while (job->arena)
+    {
+        editorArenaBlock *next = job->arena->next;
+        job->arena->next = editor.arena;
+        editor.arena = job->arena;
+        job->arena = next;
+    }
+
+    munmap(job->data, job->size);
+    free(job->chunks);
+    job->chunks = NULL;
+    job->chunksCapacity = 0;
+    job->data = NULL;
+    job->running = false;
+}
+
+void editorCloseFile(){
+    // The save thread may still be reading rows out of the arena
+    editorFinishSave();
+    editorCancelLoad();
+
+    editorReleaseChunks(editor.chunks, editor.numChunks);
+    editor.numChunks = 0;
+    editor.numRows = 0;
+    editor.hlFrontier = 0;
+    editorUndoClear();
+    editorArenaFree();
+
+    editor.cx = 0;
+    editor.cy = 0;
+    editor.rowOffset = 0;
+    editor.columnOffset = 0;
+}
+
+char* editorArenaAlloc(size_t size){
+    char *p = editorArenaAllocIn(&editor.arena, size);
+    if (p == NULL) printEditorError("Cannot allocate rows");
+    return p;
+}
+
+char* editorArenaAllocIn(editorArenaBlock **arena, size_t size){
+    editorArenaBlock *block = *arena;
+
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t blockSize = size > ZTEXT_ARENA_BLOCK ? size : ZTEXT_ARENA_BLOCK;
+        block = malloc(sizeof(editorArenaBlock) + blockSize);
+        if (block == NULL) return NULL;
+        block->next = *arena;
+        block->used = 0;
+        block->size = blockSize;
+        *arena = block;
+    }
+
+    char *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+void editorArenaFree(){
+    while (editor.arena)
+    {
+        editorArenaBlock *next = editor.arena->next;
+        free(editor.arena);
+        editor.arena = next;
+    }
+}
+
+void editorSaveFile() {
+    if (editor.save.running)
+    {
+        setStatusMessage("A save is already in progress");
+        return;
+    }
+
+    if (editor.fileName == NULL)
+    {
+        editor.fileName = editorPrompt("Save file as: %s (Press ESC to cancel)", NULL);
+        if (editor.fileName == NULL)
+        {
+            setStatusMessage("Saving sequence aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    // Whatever isn't loaded yet would go missing from the file
+    editorFinishLoad();
+    editorStartSave();
+}
+
+// Freezes the current rows and hands them to a worker thread. The snapshot is only
+// the chunk list, the chunks themselves get copied the first time an edit touches them
+void editorStartSave() {
+    editorSaveJob *job = &editor.save;
+    editorJournalSaving();
+
+    job->chunks = malloc(sizeof(editorRowChunk *) * (editor.numChunks + 1));
+    if (editor.numChunks) memcpy(job->chunks, editor.chunks, sizeof(editorRowChunk *) * editor.numChunks);
+    for (int i = 0; i < editor.numChunks; i++) editor.chunks[i]->refs++;
+    job->numChunks = editor.numChunks;
+    job->fileName = strdup(editor.fileName);
+    job->version = editor.version;
+    job->total = 0;
+    job->written = 0;
+    job->done = false;
+    job->error = 0;
+
+    if (pthread_create(&job->thread, NULL, editorSaveThread, job) != 0)
+    {
+        // No thread to be had, save right here instead
+        job->error = editorWriteFile(job->fileName, job) == 0 ? 0 : errno;
+        job->done = true;
+        job->running = true;
+        job->thread = pthread_self();
+        editorFinishSave();
+        return;
+    }
+
+    job->running = true;
+    setStatusMessage("Saving...");
+    setTimer(SAVE_TIMER, monotonicMs() + ZTEXT_PROGRESS_MS, editorShowSaveProgress);
+}
+
+void *editorSaveThread(void *arg) {
+    editorSaveJob *job = arg;
+
+    int error = editorWriteFile(job->fileName, job) == 0 ? 0 : errno;
+
+    pthread_mutex_lock(&job->lock);
+    job->error = error;
+    job->done = true;
+    pthread_mutex_unlock(&job->lock);
+
+    notifyMainLoop();
+    return NULL;
+}
+
+void editorShowSaveProgress() {
+    if (!editor.save.running) return;
+
+    pthread_mutex_lock(&editor.save.lock);
+    long long written = editor.save.written;
+    long long total = editor.save.total;
+    pthread_mutex_unlock(&editor.save.lock);
+
+    setStatusMessage("Saving... %d%% (%lld of %lld bytes)",
+        total ? (int) (written * 100 / total) : 0, written, total);
+    setTimer(SAVE_TIMER, monotonicMs() + ZTEXT_PROGRESS_MS, editorShowSaveProgress);
+}
+
+// Waits for the save thread if there is one, reports how it went and drops the snapshot
+void editorFinishSave() {
+    editorSaveJob *job = &editor.save;
+    if (!job->running) return;
+
+    if (!pthread_equal(job->thread, pthread_self())) pthread_join(job->thread, NULL);
+    job->running = false;
+    setTimer(SAVE_TIMER, 0, NULL);
+
+    if (job->error == 0)
+    {
+        // Edits made while the save ran aren't on disk, so the buffer stays modified
+        if (editor.version == job->version) editor.stinky = false;
+        editorFollowSaved(job->written);
+        editorJournalSaved(editor.version == job->version);
+        setStatusMessage("Saving successful. %lld bytes written on disk.", job->written);
+    }else
+    {
+        setStatusMessage("File saving aborted. I/O Error: %s", strerror(job->error));
+    }
+
+    editorReleaseChunks(job->chunks, job->numChunks);
+    free(job->chunks);
+    free(job->fileName);
+    job->chunks = NULL;
+    job->fileName = NULL;
+}
+
+int editorWriteFile(const char *fileName, editorSaveJob *job) {
+    return editorReplaceFile(fileName, editorWriteRows, job);
+}
+
+// Has writeContents fill a temp file next to the target and renames it over the original
+// once it's safely on disk, so a crash halfway leaves either the old file or the new one
+int editorReplaceFile(const char *fileName, int (*writeContents)(int fd, void *arg), void *arg) {
+    // Saving through a symlink should replace what it points to, not the link itself
+    char *path = realpath(fileName, NULL);
+    if (path == NULL) path = strdup(fileName);
+
+    char *slash = strrchr(path, '/');
+    int dirLength = slash ? slash - path + 1 : 0;
+    char *base = slash ? slash + 1 : path;
+
+    // Not mkstemp: its 0600 would need the umask to open up a new file, and asking for the
+    // umask means changing it for every thread. 0666 gets the umask applied by open itself
+    char *temp = malloc(strlen(path) + 40);
+    int fd = -1;
+    for (int attempt = 0; fd == -1 && attempt < 100; attempt++) {
+        sprintf(temp, "%.*s.%s.zsave%d-%d", dirLength, path, base, (int) getpid(), attempt);
+        fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd == -1 && errno != EEXIST) break;
+    }
+    if (fd == -1)
+    {
+        free(temp);
+        free(path);
+        return -1;
+    }
+
+    // Keep whatever the file had before
+    struct stat st;
+    if (stat(path, &st) == 0)
+    {
+        fchmod(fd, st.st_mode & 07777);
+        if (fchown(fd, st.st_uid, st.st_gid) == -1) {
+            // Not ours to give away, the new file just stays owned by us
+        }
+    }
+
+    bool ok = writeContents(fd, arg) != -1 && fsync(fd) != -1;
+    int savedErrno = errno;
+    if (close(fd) == -1 && ok)
+    {
+        ok = false;
+        savedErrno = errno;
+    }
+    if (ok && rename(temp, path) == -1)
+    {
+        ok = false;
+        savedErrno = errno;
+    }
+    if (!ok)
+    {
+        unlink(temp);
+        free(temp);
+        free(path);
+        errno = savedErrno;
+        return -1;
+    }
+
+    // Make the rename itself durable
+    char *dir = dirLength ? strndup(path, dirLength) : strdup(".");
+    int dirFd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirFd != -1)
+    {
+        fsync(dirFd);
+        close(dirFd);
+    }
+
+    free(dir);
+    free(temp);
+    free(path);
+    return 0;
+}
+
+// Streams the job's rows straight out of the row storage, a writev() per batch of rows
+int editorWriteRows(int fd, void *arg) {
+    editorSaveJob *job = arg;
+    static char newline[] = "\n";
+    struct iovec iov[ZTEXT_SAVE_IOV];
+    int count = 0;
+    long long total = 0;
+    long long written = 0;
+    int i, j;
+
+    for (i = 0; i < job->numChunks; i++) {
+        for (j = 0; j < job->chunks[i]->count; j++) total += job->chunks[i]->rows[j].size + 1;
+    }
+    pthread_mutex_lock(&job->lock);
+    job->total = total;
+    pthread_mutex_unlock(&job->lock);
+
+    for (i = 0; i < job->numChunks; i++) {
+        editorRowChunk *chunk = job->chunks[i];
+        for (j = 0; j < chunk->count; j++) {
+            if (count + 2 > ZTEXT_SAVE_IOV)
+            {
+                if (writevAll(fd, iov, count) == -1) return -1;
+                count = 0;
+
+                pthread_mutex_lock(&job->lock);
+                job->written = written;
+                pthread_mutex_unlock(&job->lock);
+            }
+            iov[count].iov_base = chunk->rows[j].chars;
+            iov[count++].iov_len = chunk->rows[j].size;
+            iov[count].iov_base = newline;
+            iov[count++].iov_len = 1;
+            written += chunk->rows[j].size + 1;
+        }
+    }
+
+    if (writevAll(fd, iov, count) == -1) return -1;
+
+    pthread_mutex_lock(&job->lock);
+    job->written = written;
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+// writev() until every byte is out, resuming mid-vector after a short write
+int writevAll(int fd, struct iovec *iov, int count) {
+    while (count > 0)
+    {
+        ssize_t nWritten = writev(fd, iov, count);
+        if (nWritten == -1)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        while (count > 0 && (size_t) nWritten >= iov->iov_len)
+        {
+            nWritten -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + nWritten;
+            iov->iov_len -= nWritten;
+        }
+    }
+    return 0;
+}
+
+// Terminal functions
+
+// Refills the input buffer once it runs dry, with a single read() of everything the terminal has for us.
+// Waits up to timeout ms (-1 for as long as it takes) for the terminal to have something
+bool fillInput(int timeout){
+    if(editor.inputLength > 0) return true;
+
+    struct pollfd pfds[2] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {editor.signalPipe[0], POLLIN, 0}
+    };
+
+    while(true)
+    {
+        int ready = poll(pfds, 2, timeout);
+        if(ready == -1 && errno == EINTR) continue;
+        if(ready <= 0) return false;
+
+        if(pfds[1].revents & POLLIN)
+        {
+            // Resized while we sit in a prompt or a paste, redraw and keep waiting
+            handleSignals();
+            refreshScreen();
+        }
+        if(pfds[0].revents & POLLIN) break;
+        if(pfds[0].revents & (POLLHUP | POLLERR)) exit(EXIT_FAILURE);
+    }
+
+    int nRead = read(STDIN_FILENO, editor.input, sizeof(editor.input));
+    if(nRead == -1 && errno != EAGAIN && errno != EINTR)
+    {
+        perror("Key reading error");
+    }
+    // poll() said there was something, so nothing at all means the terminal went away
+    if(nRead == 0) exit(EXIT_FAILURE);
+    if(nRead < 0) return false;
+
+    editor.inputStart = 0;
+    editor.inputLength = nRead;
+    return true;
+}
+
+bool readInputByte(char *c, int timeout){
+    if(!fillInput(timeout)) return false;
+
+    *c = editor.input[editor.inputStart++];
+    editor.inputLength--;
+    return true;
+}
+
+bool inputPending(){
+    if(editor.inputLength > 0) return true;
+
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+int readKey(){
+
+    char c;
+
+    while(!readInputByte(&c, -1));
+
+    if(c == '\x1b')
+    {
+        char sequence[3];
+
+        if(!readInputByte(&sequence[0], ZTEXT_ESCAPE_TIMEOUT_MS)) return '\x1b';
+        if(!readInputByte(&sequence[1], ZTEXT_ESCAPE_TIMEOUT_MS)) return '\x1b';
+
+        if(sequence[0] == '[')
+        {
+            if(sequence[1] >= '0' && sequence[1] <= '9')
+            {
+                int number = sequence[1] - '0';
+
+                while(true)
+                {
+                    if(!readInputByte(&sequence[2], ZTEXT_ESCAPE_TIMEOUT_MS)) return '\x1b';
+                    if(sequence[2] < '0' || sequence[2] > '9') break;
+                    number = number * 10 + (sequence[2] - '0');
+                }
+
+                if (sequence[2] == '~')
+                {
+                    switch (number)
+                    {
+                        case 1:
+                            return HOME_KEY;
+                        case 3:
+                            return DELETE_KEY;
+                        case 4:
+                            return END_KEY;
+                        case 7:
+                            return HOME_KEY;
+                        case 8:
+                            return END_KEY;
+                        case 5:
+                            return PAGE_UP;
+                        case 6:
+                            return PAGE_DOWN;
+                        case 200:
+                            return PASTE_START;
+                        case 201:
+                            return PASTE_END;
+                    }
+                }
+            }else
+            {
+                switch (sequence[1])
+                {
+                    case 'A':
+                        return ARROW_UP;
+                    case 'B':
+                        return ARROW_DOWN;
+                    case 'C':
+                        return ARROW_RIGHT;
+                    case 'D':
+                        return ARROW_LEFT;
+                    case 'H':
+                        return HOME_KEY;
+                    case 'F':
+                        return END_KEY;
+                }
+            }
+        }
+        return '\x1b';
+    }
+
+    return (unsigned char)c;
+
+}
+
+void enableRawInput(){
+
+    if(tcgetattr(STDIN_FILENO, &editor.og_termios) == -1){
+        printEditorError("Get terminal attributes upon enabling raw mode error");
+    }
+    atexit(disableRawInput);
+
+    struct termios raw = editor.og_termios;
+
+    // Disabling all possible flags bitwise
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);    
+    raw.c_oflag &= ~(OPOST);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_cflag |= (CS8);
+    // Reads never block, the event loop polls before every one of them
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+
+    if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1){
+        printEditorError("Set terminal attributes upon enabling raw mode error");
+    }
+
+    // Bracketed paste, so a paste arrives as one block instead of a storm of keys
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+void disableRawInput(){
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+
+    // If this messes up, we're in deep shit
+    if(tcsetattr(STDERR_FILENO, TCSAFLUSH, &editor.og_termios) == -1)
+    {
+        printEditorError("Set terminal attributes upon disabling raw mode error");
+    }
+}
+
+void printEditorError(const char *s){
+    if (!editor.batch)
+    {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+    }
+
+    // *pain.jpg*
+    perror(s);
+    exit(EXIT_FAILURE);
+}
+
+int getWindowSize(int *rows, int *columns){
+    struct winsize windowSize;
+    
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &windowSize) == -1 || windowSize.ws_col == 0)
+    {
+        if(write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12){
+            return -1;
+        }
+        return getCursorPos(rows, columns);
+    }else
+    {
+        *rows = windowSize.ws_row;
+        *columns = windowSize.ws_col;
+        return 0;
+    }
+}
+
+int getCursorPos(int *rows, int *columns){
+
+    char buf[32];
+    unsigned int i = 0;
+
+    if(write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+    while (i < sizeof(buf) - 1)
+    {
+        if(poll(&pfd, 1, 1000) != 1) break;
+        if(read(STDIN_FILENO, &buf[i], 1) != 1) break;
+        if(buf[i] == 'R') break;
+        i++;
+    }
+    buf[i] = '\0';
+
+    if(buf[0] != '\x1b' || buf[1] != '[') return -1;
+    if(sscanf(&buf[2], "%d;%d", rows, columns) != 2) return -1;
+
+    return 0;
+}
+
+// Event loop
+
+void initializeEventLoop(){
+    // SIGWINCH only pokes this pipe, the real work happens back in the loop
+    if(pipe(editor.signalPipe) == -1) printEditorError("Cannot create signal pipe");
+    for(int i = 0; i < 2; i++)
+    {
+        fcntl(editor.signalPipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(editor.signalPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleWindowChange;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+
+    if(pipe(editor.workerPipe) == -1) printEditorError("Cannot create worker pipe");
+    for(int i = 0; i < 2; i++)
+    {
+        fcntl(editor.workerPipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(editor.workerPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    watchFd(STDIN_FILENO, processInputs);
+    watchFd(editor.signalPipe[0], handleSignals);
+    watchFd(editor.workerPipe[0], handleWorkers);
+}
+
+// Safe to call from any thread
+void notifyMainLoop(){
+    write(editor.workerPipe[1], "w", 1);
+}
+
+void handleWorkers(){
+    char buf[64];
+    while(read(editor.workerPipe[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&editor.save.lock);
+    bool saved = editor.save.running && editor.save.done;
+    pthread_mutex_unlock(&editor.save.lock);
+    if(saved) editorFinishSave();
+
+    editorMergeLoaded();
+    editorViewMergeIndex();
+}
+
+void handleWindowChange(int signal){
+    (void) signal;
+    int savedErrno = errno;
+    write(editor.signalPipe[1], "w", 1);
+    errno = savedErrno;
+}
+
+// SIGHUP when the terminal goes away, SIGTERM when someone wants us gone
+void handleHangup(int signal){
+    (void) signal;
+    int savedErrno = errno;
+    write(editor.signalPipe[1], "h", 1);
+    errno = savedErrno;
+}
+
+void handleSignals(){
+    char buf[64];
+    ssize_t nRead;
+    bool hangup = false;
+    while((nRead = read(editor.signalPipe[0], buf, sizeof(buf))) > 0) hangup = hangup || memchr(buf, 'h', nRead);
+
+    // Whatever the journal holds by now is what the next start recovers
+    if(hangup){
+        editorJournalFlush();
+        exit(EXIT_FAILURE);
+    }
+
+    if(getWindowSize(&editor.terminalRows, &editor.terminalColumns) == -1) return;
+    editor.terminalRows -= 2;
+    editor.screenValid = false;
+}
+
+void watchFd(int fd, void (*callback)()){
+    if(editor.numWatches == ZTEXT_MAX_WATCHES) printEditorError("Too many watched descriptors");
+    editor.watches[editor.numWatches].fd = fd;
+    editor.watches[editor.numWatches].callback = callback;
+    editor.numWatches++;
+}
+
+void unwatchFd(int fd){
+    for(int i = 0; i < editor.numWatches; i++)
+    {
+        if(editor.watches[i].fd == fd)
+        {
+            editor.watches[i] = editor.watches[--editor.numWatches];
+            return;
+        }
+    }
+}
+
+void setTimer(int id, long long deadline, void (*callback)()){
+    editor.timers[id].deadline = deadline;
+    editor.timers[id].callback = callback;
+}
+
+long long monotonicMs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Sleeps until a watched descriptor turns readable or a timer runs out, then runs
+// whatever was due. Nothing armed and nothing to read means poll() with no timeout at all
+void waitForEvents(){
+    struct pollfd pfds[ZTEXT_MAX_WATCHES];
+    int numWatches = editor.numWatches;
+    editorWatch watches[ZTEXT_MAX_WATCHES];
+    memcpy(watches, editor.watches, sizeof(editorWatch) * numWatches);
+
+    for(int i = 0; i < numWatches; i++)
+    {
+        pfds[i].fd = watches[i].fd;
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+
+    long long now = monotonicMs();
+    int timeout = -1;
+    for(int i = 0; i < TIMER_COUNT; i++)
+    {
+        if(editor.timers[i].deadline == 0) continue;
+        long long wait = editor.timers[i].deadline - now;
+        if(wait < 0) wait = 0;
+        if(timeout == -1 || wait < timeout) timeout = wait;
+    }
+    if(editor.inputLength > 0) timeout = 0;
+
+    int ready = poll(pfds, numWatches, timeout);
+    if(ready == -1 && errno != EINTR) printEditorError("Event loop poll error");
+
+    now = monotonicMs();
+    for(int i = 0; i < TIMER_COUNT; i++)
+    {
+        if(editor.timers[i].deadline == 0 || editor.timers[i].deadline > now) continue;
+        editor.timers[i].deadline = 0;
+        if(editor.timers[i].callback) editor.timers[i].callback();
+    }
+
+    for(int i = 0; i < numWatches && ready > 0; i++)
+    {
+        if(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) watches[i].callback();
+    }
+    if(editor.inputLength > 0) processInputs();
+}
+
+// Worker pool
+
+// Runs task over items 0..numItems-1 on the pool and the calling thread, returns once all are done
+void editorRunParallel(void (*task)(int item, void *arg), void *arg, int numItems){
+    editorWorkerPool *pool = &editor.pool;
+
+    if (!pool->started)
+    {
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->wake, NULL);
+        pthread_cond_init(&pool->idle, NULL);
+
+        // The main thread does its share too, so one core means no extra threads at all
+        long cores = editor.poolCores ? editor.poolCores : sysconf(_SC_NPROCESSORS_ONLN);
+        int wanted = cores > ZTEXT_MAX_WORKERS ? ZTEXT_MAX_WORKERS - 1 : (int) cores - 1;
+        for (int i = 0; i < wanted; i++) {
+            if (pthread_create(&pool->threads[pool->numThreads], NULL, editorPoolThread, NULL) != 0) break;
+            pool->numThreads++;
+        }
+        pool->started = true;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->nextItem = 0;
+    pool->numItems = numItems;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+
+    pool->busy++;
+    editorPoolWork();
+    pool->busy--;
+    while (pool->busy > 0) pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *editorPoolThread(void *arg){
+    (void) arg;
+    editorWorkerPool *pool = &editor.pool;
+    unsigned long seen = 0;
+
+    // Workers block signals so SIGWINCH always lands on the main thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (pool->generation == seen) pthread_cond_wait(&pool->wake, &pool->lock);
+        seen = pool->generation;
+
+        pool->busy++;
+        editorPoolWork();
+        if (--pool->busy == 0) pthread_cond_broadcast(&pool->idle);
+    }
+    return NULL;
+}
+
+// Takes items off the current job until there are none left. Called and returns with the pool locked
+void editorPoolWork(){
+    editorWorkerPool *pool = &editor.pool;
+
+    while (pool->nextItem < pool->numItems)
+    {
+        int item = pool->nextItem++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(item, pool->arg);
+        pthread_mutex_lock(&pool->lock);
+    }
+}
+
+// Row storage functions
+
+// The chunk list is indexed by a Fenwick tree over the row count of each chunk,
+// so looking up a row and updating the counts after an edit are both O(log n)
+
+void editorGrowChunks(int needed){
+    if (needed <= editor.chunkCapacity) return;
+
+    int capacity = editor.chunkCapacity ? editor.chunkCapacity : 16;
+    while (capacity < needed) capacity *= 2;
+
+    editor.chunks = realloc(editor.chunks, sizeof(editorRowChunk *) * capacity);
+    editor.chunkIndex = realloc(editor.chunkIndex, sizeof(int) * (capacity + 1));
+    if (editor.chunks == NULL || editor.chunkIndex == NULL) printEditorError("Cannot allocate rows");
+    editor.chunkCapacity = capacity;
+}
+
+void editorRebuildChunkIndex(){
+    int i;
+    for (i = 1; i <= editor.numChunks; i++) editor.chunkIndex[i] = editor.chunks[i - 1]->count;
+    for (i = 1; i <= editor.numChunks; i++) {
+        int parent = i + (i & -i);
+        if (parent <= editor.numChunks) editor.chunkIndex[parent] += editor.chunkIndex[i];
+    }
+}
+
+void editorChunkIndexAdd(int chunk, int delta){
+    for (int i = chunk + 1; i <= editor.numChunks; i += i & -i) editor.chunkIndex[i] += delta;
+}
+
+int editorFindChunk(int at, int *offset){
+    int mask = 1;
+    while (mask * 2 <= editor.numChunks) mask *= 2;
+
+    int chunk = 0;
+    for (; mask; mask /= 2) {
+        int next = chunk + mask;
+        if (next <= editor.numChunks && editor.chunkIndex[next] <= at) {
+            chunk = next;
+            at -= editor.chunkIndex[next];
+        }
+    }
+
+    *offset = at;
+    return chunk;
+}
+
+editorRowChunk* editorInsertChunk(int index){
+    editorGrowChunks(editor.numChunks + 1);
+
+    editorRowChunk *chunk = malloc(sizeof(editorRowChunk));
+    if (chunk == NULL) printEditorError("Cannot allocate rows");
+    chunk->count = 0;
+    chunk->refs = 1;
+
+    memmove(&editor.chunks[index + 1], &editor.chunks[index],
+        sizeof(editorRowChunk *) * (editor.numChunks - index));
+    editor.chunks[index] = chunk;
+    editor.numChunks++;
+
+    // The new chunk is empty, so a tail append keeps every existing index entry valid
+    if (index == editor.numChunks - 1) {
+        int i = editor.numChunks;
+        int sum = 0;
+        int j;
+        for (j = i - 1; j > 0; j -= j & -j) sum += editor.chunkIndex[j];
+        for (j = i - (i & -i); j > 0; j -= j & -j) sum -= editor.chunkIndex[j];
+        editor.chunkIndex[i] = sum;
+    }else {
+        editorRebuildChunkIndex();
+    }
+
+    return chunk;
+}
+
+void editorRemoveChunk(int index){
+    memmove(&editor.chunks[index], &editor.chunks[index + 1],
+        sizeof(editorRowChunk *) * (editor.numChunks - index - 1));
+    editor.numChunks--;
+    editorRebuildChunkIndex();
+}
+
+editorRow* editorRowAt(int at){
+    if (at < 0 || at >= editor.numRows) return NULL;
+
+    int offset;
+    int chunk = editorFindChunk(at, &offset);
+    return &editor.chunks[chunk]->rows[offset];
+}
+
+// Same as editorRowAt, for callers about to change the row
+editorRow* editorRowForEdit(int at){
+    if (at < 0 || at >= editor.numRows) return NULL;
+
+    int offset;
+    int chunk = editorFindChunk(at, &offset);
+    return &editorChunkForEdit(chunk)->rows[offset];
+}
+
+// Unshares chunk c before it gets modified. The copy gets its own row bytes, so the
+// snapshot keeps seeing the rows exactly as they were
+editorRowChunk* editorChunkForEdit(int c){
+    editorRowChunk *chunk = editor.chunks[c];
+    if (chunk->refs == 1) return chunk;
+
+    editorRowChunk *copy = malloc(sizeof(editorRowChunk));
+    if (copy == NULL) printEditorError("Cannot allocate rows");
+    copy->count = chunk->count;
+    copy->refs = 1;
+
+    for (int i = 0; i < chunk->count; i++) {
+        editorRow *row = &copy->rows[i];
+        *row = chunk->rows[i];
+        row->chars = editorArenaAlloc(row->size + 1);
+        memcpy(row->chars, chunk->rows[i].chars, row->size + 1);
+        row->capacity = row->size + 1;
+        row->flags |= ZTEXT_ROW_ARENA_CHARS;
+    }
+
+    chunk->refs--;
+    editor.chunks[c] = copy;
+    return copy;
+}
+
+// Drops one reference to each chunk, freeing the ones nobody else holds
+void editorReleaseChunks(editorRowChunk **chunks, int numChunks){
+    for (int i = 0; i < numChunks; i++) {
+        editorRowChunk *chunk = chunks[i];
+        if (--chunk->refs > 0) continue;
+        for (int j = 0; j < chunk->count; j++) editorFreeRow(&chunk->rows[j]);
+        free(chunk);
+    }
+}
+
+// Makes room for a new row at position `at` and returns it, the caller fills it in
+editorRow* editorOpenRowSlot(int at){
+    int c, offset;
+
+    if (at == editor.numRows)
+    {
+        c = editor.numChunks - 1;
+        if (c < 0 || editor.chunks[c]->count == ZTEXT_CHUNK_ROWS)
+        {
+            editorInsertChunk(editor.numChunks);
+            c = editor.numChunks - 1;
+        }
+        offset = editor.chunks[c]->count;
+    }else
+    {
+        c = editorFindChunk(at, &offset);
+    }
+
+    editorRowChunk *chunk = editorChunkForEdit(c);
+    if (chunk->count == ZTEXT_CHUNK_ROWS)
+    {
+        int half = ZTEXT_CHUNK_ROWS / 2;
+        editorRowChunk *next = editorInsertChunk(c + 1);
+        memcpy(next->rows, &chunk->rows[half], sizeof(editorRow) * (ZTEXT_CHUNK_ROWS - half));
+        next->count = ZTEXT_CHUNK_ROWS - half;
+        chunk->count = half;
+        editorRebuildChunkIndex();
+
+        if (offset > half)
+        {
+            chunk = next;
+            offset -= half;
+            c++;
+        }
+    }
+
+    memmove(&chunk->rows[offset + 1], &chunk->rows[offset],
+        sizeof(editorRow) * (chunk->count - offset));
+    chunk->count++;
+    editorChunkIndexAdd(c, 1);
+    editor.numRows++;
+
+    return &chunk->rows[offset];
+}
+
+// Row operation functions
+
+// The tab marks come with the render, so a row keeps them for as long as it stays cached
+editorRenderSlot* editorRowMarks(editorRow *row) {
+    int length;
+    editorRowRender(row, &length);
+    return &editor.renderCache[row->renderSlot];
+}
+
+// Index of the last mark starting at or before value (a column, or else a byte of chars), -1 if there's none
+int editorLastMark(editorRenderSlot *slot, int value, bool byColumn) {
+    int low = 0;
+    int high = slot->numMarks;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int start = byColumn ? slot->marks[mid].rx : slot->marks[mid].cx;
+        if (start <= value) low = mid + 1;
+        else high = mid;
+    }
+    return low - 1;
+}
+
+int editorRowCxToRx(editorRow *row, int cx){
+    if (!(row->flags & (ZTEXT_ROW_TABS | ZTEXT_ROW_UTF8))) return cx;
+
+    // Long rows walk from the checkpoint before cx
+    if (row->size >= ZTEXT_LONG_LINE)
+    {
+        editorRenderSlot *slot = editorRowCheckpoints(row);
+        editorLineCheckpoint *checkpoint = &slot->checkpoints[editorLastCheckpoint(slot, cx, false)];
+        int at = checkpoint->cx;
+        int rx = checkpoint->rx;
+        while (at < cx)
+        {
+            int columns;
+            int bytes = editorCharColumns(row, at, rx, &columns);
+            if (at + bytes > cx) break;
+            at += bytes;
+            rx += columns;
+        }
+        return rx;
+    }
+
+    editorRenderSlot *slot = editorRowMarks(row);
+    int i = editorLastMark(slot, cx, false);
+    if (i < 0) return cx;
+
+    editorColumnMark *mark = &slot->marks[i];
+    if (cx < mark->cx + mark->bytes) return mark->rx;
+    return mark->rx + mark->columns + (cx - mark->cx - mark->bytes);
+}
+
+// A column inside a tab or a wide character lands on it
+int editorRowRxToCx(editorRow *row, int rx){
+    int cx = rx;
+    if ((row->flags & (ZTEXT_ROW_TABS | ZTEXT_ROW_UTF8)) && row->size >= ZTEXT_LONG_LINE)
+    {
+        editorRenderSlot *slot = editorRowCheckpoints(row);
+        editorLineCheckpoint *checkpoint = &slot->checkpoints[editorLastCheckpoint(slot, rx, true)];
+        int at = checkpoint->rx;
+        cx = checkpoint->cx;
+        while (cx < row->size)
+        {
+            int columns;
+            int bytes = editorCharColumns(row, cx, at, &columns);
+            if (rx < at + columns) break;
+            cx += bytes;
+            at += columns;
+        }
+    }else if (row->flags & (ZTEXT_ROW_TABS | ZTEXT_ROW_UTF8))
+    {
+        editorRenderSlot *slot = editorRowMarks(row);
+        int i = editorLastMark(slot, rx, true);
+        if (i >= 0)
+        {
+            editorColumnMark *mark = &slot->marks[i];
+            if (rx < mark->rx + mark->columns) cx = mark->cx;
+            else cx = mark->cx + mark->bytes + (rx - mark->rx - mark->columns);
+        }
+    }
+    return cx < row->size ? cx : row->size;
+}
+
+// Where screen column rx starts in the render. A wide character that rx cuts in half is skipped
+// when `after` (the left edge of the screen) and left out otherwise (the right edge), *pad gets
+// the columns that leaves blank. Tabs are just spaces in the render, those can be cut anywhere
+int editorRenderOffset(editorRenderSlot *slot, int rx, bool after, int *pad) {
+    *pad = 0;
+
+    int i = editorLastMark(slot, rx, true);
+    if (i < 0) return rx - slot->windowRx;
+
+    editorColumnMark *mark = &slot->marks[i];
+    if (rx >= mark->rx + mark->columns) return mark->ro + mark->renderBytes + (rx - mark->rx - mark->columns);
+    if (rx == mark->rx || mark->bytes == 1) return mark->ro + (rx - mark->rx);
+
+    if (after)
+    {
+        *pad = mark->rx + mark->columns - rx;
+        return mark->ro + mark->renderBytes;
+    }
+    *pad = rx - mark->rx;
+    return mark->ro;
+}
+
+// The render bytes that fill the screen from columnOffset on, returns where they stop
+int editorVisibleRender(editorRow *row, int renderSize, int *from, int *padLeft, int *padRight) {
+    int first = editor.columnOffset;
+    int last = editor.columnOffset + editor.terminalColumns;
+    int to;
+
+    *padLeft = 0;
+    *padRight = 0;
+    if (row->flags & (ZTEXT_ROW_TABS | ZTEXT_ROW_UTF8))
+    {
+        // The render was just built, so the row still holds its slot
+        editorRenderSlot *slot = &editor.renderCache[row->renderSlot];
+        *from = editorRenderOffset(slot, first, true, padLeft);
+        to = editorRenderOffset(slot, last, false, padRight);
+    }else
+    {
+        *from = first;
+        to = last;
+    }
+
+    if (*from < 0) *from = 0;
+    if (*from > renderSize) *from = renderSize;
+    if (to > renderSize) to = renderSize;
+    return to > *from ? to : *from;
+}
+
+// Cursor steps go a whole character at a time, combining marks included
+int editorRowNextChar(editorRow *row, int cx) {
+    if (cx >= row->size) return row->size;
+    if (!(row->flags & ZTEXT_ROW_UTF8)) return cx + 1;
+
+    unsigned int codepoint;
+    cx += editorDecodeChar(&row->chars[cx], row->size - cx, &codepoint);
+    while (cx < row->size)
+    {
+        int n = editorDecodeChar(&row->chars[cx], row->size - cx, &codepoint);
+        if (n == 1 || editorCharWidth(codepoint) != 0) break;
+        cx += n;
+    }
+    return cx;
+}
+
+int editorRowPrevChar(editorRow *row, int cx) {
+    if (cx <= 0) return 0;
+    if (!(row->flags & ZTEXT_ROW_UTF8)) return cx - 1;
+
+    unsigned int codepoint;
+    do {
+        int start = cx - 1;
+        while (start > 0 && cx - start < 4 && (row->chars[start] & 0xC0) == 0x80) start--;
+
+        // Stray continuation bytes go one at a time, like they do forwards
+        if (editorDecodeChar(&row->chars[start], cx - start, &codepoint) != cx - start)
+        {
+            start = cx - 1;
+            codepoint = 0xFFFD;
+        }
+        cx = start;
+    } while (cx > 0 && editorCharWidth(codepoint) == 0);
+
+    return cx;
+}
+
+// Tells what a row needs besides byte for byte rendering: tabs to expand, or bytes past ASCII
+// to decode. Plain ASCII, by far the common case, is one vector pass that comes back with 0
+int editorScanText(const char *s, size_t len){
+    int flags = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // A tab compares to 0xff, so one movemask tells whether a block has anything at all.
+    // The last block overlaps the one before it rather than leaving a scalar tail
+    const __m128i tab16 = _mm_set1_epi8('\t');
+    if (len >= 16)
+    {
+        while (i < len)
+        {
+            size_t at = i + 16 <= len ? i : len - 16;
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(s + at));
+            __m128i tabs = _mm_cmpeq_epi8(chunk, tab16);
+            if (_mm_movemask_epi8(_mm_or_si128(chunk, tabs)))
+            {
+                if (_mm_movemask_epi8(chunk)) flags |= ZTEXT_ROW_UTF8;
+                if (_mm_movemask_epi8(tabs)) flags |= ZTEXT_ROW_TABS;
+                if (flags == (ZTEXT_ROW_TABS | ZTEXT_ROW_UTF8)) break;
+            }
+            i = at + 16;
+        }
+        return flags;
+    }
+#endif
+    for (; i < len; i++) {
+        if (s[i] == '\t') flags |= ZTEXT_ROW_TABS;
+        else if ((unsigned char)s[i] >= 0x80) flags |= ZTEXT_ROW_UTF8;
+    }
+
+    return flags;
+}
+
+// editorScanText() and memchr() for the line end rolled into one pass, for the loader.
+// Returns the newline, or NULL when the line runs to the end of the data
+const char* editorScanLine(const char *s, const char *end, int *flags){
+    *flags = 0;
+
+#ifdef __SSE2__
+    const __m128i newline16 = _mm_set1_epi8('\n');
+    const __m128i tab16 = _mm_set1_epi8('\t');
+    while (end - s >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)s);
+        __m128i tabs = _mm_cmpeq_epi8(chunk, tab16);
+        unsigned newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline16));
+        unsigned special = _mm_movemask_epi8(_mm_or_si128(chunk, tabs));
+
+        // Only what comes before the newline belongs to this line
+        unsigned line = newlines ? (newlines & -newlines) - 1 : 0xffff;
+        if (special & line)
+        {
+            if (_mm_movemask_epi8(chunk) & line) *flags |= ZTEXT_ROW_UTF8;
+            if (_mm_movemask_epi8(tabs) & line) *flags |= ZTEXT_ROW_TABS;
+        }
+        if (newlines) return s + __builtin_ctz(newlines);
+        s += 16;
+    }
+#endif
+    for (; s < end; s++) {
+        if (*s == '\n') return s;
+        if (*s == '\t') *flags |= ZTEXT_ROW_TABS;
+        else if ((unsigned char)*s >= 0x80) *flags |= ZTEXT_ROW_UTF8;
+    }
+
+    return NULL;
+}
+
+// Decodes the UTF-8 character at s and returns how many bytes it takes. Anything malformed,
+// overlong or cut short comes back as a single byte with a 0xFFFD codepoint
+int editorDecodeChar(const char *s, int length, unsigned int *codepoint) {
+    const unsigned char *u = (const unsigned char *)s;
+    unsigned int value;
+    unsigned int min;
+    int n;
+
+    if (u[0] < 0x80)
+    {
+        *codepoint = u[0];
+        return 1;
+    }
+
+    if ((u[0] & 0xE0) == 0xC0) { n = 2; value = u[0] & 0x1F; min = 0x80; }
+    else if ((u[0] & 0xF0) == 0xE0) { n = 3; value = u[0] & 0x0F; min = 0x800; }
+    else if ((u[0] & 0xF8) == 0xF0) { n = 4; value = u[0] & 0x07; min = 0x10000; }
+    else n = 0;
+
+    *codepoint = 0xFFFD;
+    if (n == 0 || n > length) return 1;
+    for (int i = 1; i < n; i++) {
+        if ((u[i] & 0xC0) != 0x80) return 1;
+        value = (value << 6) | (u[i] & 0x3F);
+    }
+    if (value < min || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)) return 1;
+
+    *codepoint = value;
+    return n;
+}
+
+// Combining marks and other zero width characters
+static const unsigned int zeroWidthRanges[][2] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+    {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+    {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1160, 0x11FF}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D},
+    {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF}
+};
+
+// East Asian wide and fullwidth characters, emoji included
+static const unsigned int wideRanges[][2] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x3029}, {0x302E, 0x303E}, {0x3041, 0x3098}, {0x309B, 0x33FF}, {0x3400, 0x4DBF},
+    {0x4E00, 0x9FFF}, {0xA000, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+    {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+    {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+    {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C},
+    {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4},
+    {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+    {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F},
+    {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC},
+    {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF},
+    {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+static bool inRanges(const unsigned int ranges[][2], int count, unsigned int codepoint) {
+    if (codepoint < ranges[0][0] || codepoint > ranges[count - 1][1]) return false;
+
+    int low = 0;
+    int high = count - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (codepoint > ranges[mid][1]) low = mid + 1;
+        else if (codepoint < ranges[mid][0]) high = mid - 1;
+        else return true;
+    }
+    return false;
+}
+
+// Screen columns a character takes up
+int editorCharWidth(unsigned int codepoint) {
+    if (codepoint < 0x300) return 1;
+    if (inRanges(zeroWidthRanges, sizeof(zeroWidthRanges) / sizeof(zeroWidthRanges[0]), codepoint)) return 0;
+    if (inRanges(wideRanges, sizeof(wideRanges) / sizeof(wideRanges[0]), codepoint)) return 2;
+    return 1;
+}
+
+int editorRenderLength(editorRow *row) {
+    int tabs = 0;
+    for (int i = 0; i < row->size; i++) if (row->chars[i] == '\t') tabs++;
+    return row->size + tabs*(ZTEXT_TAB_STOP - 1);
+}
+
+// Edits only drop the cached render, it gets rebuilt if and when the row is drawn
+void editorUpdateRow(editorRow *row) {
+    row->flags &= ~(ZTEXT_ROW_TABS | ZTEXT_ROW_UTF8);
+    row->flags |= editorScanText(row->chars, row->size);
+    row->renderStamp = 0;
+}
+
+// Expands tabs, copies everything else over and marks whatever isn't a byte on a column, from
+// byte `from` (on column rx) until the row ends or the render gets to column `last`.
+// Malformed UTF-8 and C1 controls would upset the terminal, they show up as '?' instead
+int editorFillRender(editorRow *row, editorRenderSlot *slot, int from, int rx, int last) {
+    int i = from;
+    int index = 0;
+
+    slot->numMarks = 0;
+    slot->windowRx = rx;
+    while (i < row->size && rx < last)
+    {
+        // Windows aren't sized up front, no character renders to more than this
+        if (index + ZTEXT_TAB_STOP + 4 >= slot->capacity) editorRenderReserve(slot, index + ZTEXT_TAB_STOP + 4 + 1);
+        char *render = slot->render;
+        unsigned char c = row->chars[i];
+        int bytes = 1;
+        int columns = 1;
+        int renderBytes = 1;
+
+        if (c == '\t')
+        {
+            columns = ZTEXT_TAB_STOP - rx % ZTEXT_TAB_STOP;
+            renderBytes = columns;
+            memset(&render[index], ' ', columns);
+        }else if (c < 0x80)
+        {
+            render[index] = c;
+        }else
+        {
+            unsigned int codepoint;
+            bytes = editorDecodeChar(&row->chars[i], row->size - i, &codepoint);
+            if (bytes == 1 || codepoint < 0xA0)
+            {
+                render[index] = '?';
+            }else
+            {
+                columns = editorCharWidth(codepoint);
+                renderBytes = bytes;
+                memcpy(&render[index], &row->chars[i], bytes);
+            }
+        }
+
+        if (bytes != 1 || columns != 1 || renderBytes != 1)
+        {
+            if (slot->numMarks == slot->marksCapacity)
+            {
+                slot->marksCapacity = slot->marksCapacity ? slot->marksCapacity * 2 : 16;
+                slot->marks = realloc(slot->marks, sizeof(editorColumnMark) * slot->marksCapacity);
+                if (slot->marks == NULL) printEditorError("Cannot allocate render");
+                editor.allocations++;
+            }
+            editorColumnMark *mark = &slot->marks[slot->numMarks++];
+            mark->cx = i;
+            mark->rx = rx;
+            mark->ro = index;
+            mark->bytes = bytes;
+            mark->columns = columns;
+            mark->renderBytes = renderBytes;
+        }
+
+        i += bytes;
+        rx += columns;
+        index += renderBytes;
+    }
+
+    slot->windowEnd = i < row->size ? rx : INT_MAX;
+    editorRenderReserve(slot, index + 1);
+    slot->render[index] = '\0';
+    return index;
+}
+
+char* editorRowRender(editorRow *row, int *length) {
+    // Plain ASCII without tabs renders byte for byte, so just hand out chars.
+    // Highlighting needs a slot to keep the colors in though, except on long rows that go without
+    if (!(row->flags & (ZTEXT_ROW_TABS | ZTEXT_ROW_UTF8)) && (editor.syntax == NULL || row->size >= ZTEXT_LONG_LINE))
+    {
+        *length = row->size;
+        return row->chars;
+    }
+    if (row->size >= ZTEXT_LONG_LINE) return editorRowWindow(row, length);
+
+    bool fresh;
+    editorRenderSlot *slot = editorRowSlot(row, &fresh);
+    if (fresh || slot->windowed)
+    {
+        editorRenderReserve(slot, editorRenderLength(row) + 1);
+        slot->size = editorFillRender(row, slot, 0, 0, INT_MAX);
+        slot->windowed = false;
+        slot->hlStart = -1;
+    }
+
+    *length = slot->size;
+    return slot->render;
+}
+
+// The row's slot in the render cache. A row that lost its slot takes over the least recently
+// used one, with *fresh set so the caller knows to fill it in
+editorRenderSlot* editorRowSlot(editorRow *row, bool *fresh) {
+    editor.renderClock++;
+
+    editorRenderSlot *slot = &editor.renderCache[row->renderSlot];
+    *fresh = row->renderStamp == 0 || slot->stamp != row->renderStamp;
+    if (*fresh)
+    {
+        int victim = 0;
+        for (int i = 1; i < ZTEXT_RENDER_CACHE_SLOTS; i++) {
+            if (editor.renderCache[i].lastUsed < editor.renderCache[victim].lastUsed) victim = i;
+        }
+        slot = &editor.renderCache[victim];
+        slot->stamp = ++editor.renderStamp;
+        slot->hlStart = -1;
+        row->renderSlot = victim;
+        row->renderStamp = slot->stamp;
+    }
+
+    slot->lastUsed = editor.renderClock;
+    return slot;
+}
+
+void editorRenderReserve(editorRenderSlot *slot, int needed) {
+    if (needed <= slot->capacity) return;
+
+    int capacity = slot->capacity ? slot->capacity : ZTEXT_ROW_MIN_CAPACITY;
+    while (capacity < needed) capacity *= 2;
+    slot->render = realloc(slot->render, capacity);
+    if (slot->render == NULL) printEditorError("Cannot allocate render");
+    slot->capacity = capacity;
+    editor.allocations++;
+}
+
+// Long rows
+
+// A row past ZTEXT_LONG_LINE never gets rendered whole. Its slot keeps checkpoints along the row
+// instead, and a render of just the stretch on screen that starts at the checkpoint before
+// columnOffset. Edits patch the checkpoints around them, so typing costs about a screen's
+// worth of work (plus moving the row's bytes) however long the row is
+
+char* editorRowWindow(editorRow *row, int *length) {
+    editorRenderSlot *slot = editorRowCheckpoints(row);
+    int first = editor.columnOffset;
+    int last = editor.columnOffset + editor.terminalColumns;
+
+    if (slot->windowEnd < 0 || first < slot->windowRx || last >= slot->windowEnd)
+    {
+        editorLineCheckpoint *checkpoint = &slot->checkpoints[editorLastCheckpoint(slot, first, true)];
+        // Some slack on the right, so moving along a little keeps the same window
+        slot->size = editorFillRender(row, slot, checkpoint->cx, checkpoint->rx, last + editor.terminalColumns);
+    }
+
+    *length = slot->size;
+    return slot->render;
+}
+
+// Bytes and columns taken by the character at cx when it starts on column rx, the same way
+// editorFillRender() lays it out
+int editorCharColumns(editorRow *row, int cx, int rx, int *columns) {
+    unsigned char c = row->chars[cx];
+    if (c == '\t')
+    {
+        *columns = ZTEXT_TAB_STOP - rx % ZTEXT_TAB_STOP;
+        return 1;
+    }
+
+    *columns = 1;
+    if (c < 0x80) return 1;
+
+    unsigned int codepoint;
+    int bytes = editorDecodeChar(&row->chars[cx], row->size - cx, &codepoint);
+    if (bytes > 1 && codepoint >= 0xA0) *columns = editorCharWidth(codepoint);
+    return bytes;
+}
+
+void editorBuildCheckpoints(editorRow *row, editorRenderSlot *slot) {
+    int cx = 0;
+    int rx = 0;
+
+    slot->numCheckpoints = 0;
+    while (true)
+    {
+        editorAddCheckpoint(slot, slot->numCheckpoints, cx, rx);
+
+        int end = cx + ZTEXT_LINE_CHECKPOINT < row->size ? cx + ZTEXT_LINE_CHECKPOINT : row->size;
+        bool tabs = false;
+        if (editorScanText(&row->chars[cx], end - cx) == 0)
+        {
+            // Plain ASCII all the way, bytes are columns
+            rx += end - cx;
+            cx = end;
+        }
+        while (cx < end)
+        {
+            int columns;
+            if (row->chars[cx] == '\t') tabs = true;
+            cx += editorCharColumns(row, cx, rx, &columns);
+            rx += columns;
+        }
+        slot->checkpoints[slot->numCheckpoints - 1].tabs = tabs;
+
+        if (cx >= row->size) break;
+    }
+}
+
+void editorAddCheckpoint(editorRenderSlot *slot, int at, int cx, int rx) {
+    if (slot->numCheckpoints == slot->checkpointsCapacity)
+    {
+        slot->checkpointsCapacity = slot->checkpointsCapacity ? slot->checkpointsCapacity * 2 : 64;
+        slot->checkpoints = realloc(slot->checkpoints, sizeof(editorLineCheckpoint) * slot->checkpointsCapacity);
+        if (slot->checkpoints == NULL) printEditorError("Cannot allocate checkpoints");
+        editor.allocations++;
+    }
+
+    memmove(&slot->checkpoints[at + 1], &slot->checkpoints[at],
+        sizeof(editorLineCheckpoint) * (slot->numCheckpoints - at));
+    slot->checkpoints[at].cx = cx;
+    slot->checkpoints[at].rx = rx;
+    slot->checkpoints[at].tabs = false;
+    slot->numCheckpoints++;
+}
+
+// Index of the last checkpoint at or before value (a column, or else a byte). The first
+// checkpoint sits at the very start of the row, so there always is one
+int editorLastCheckpoint(editorRenderSlot *slot, int value, bool byColumn) {
+    int low = 0;
+    int high = slot->numCheckpoints;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int start = byColumn ? slot->checkpoints[mid].rx : slot->checkpoints[mid].cx;
+        if (start <= value) low = mid + 1;
+        else high = mid;
+    }
+    return low - 1;
+}
+
+// The row's slot with its checkpoints in place, they're only worked out from scratch
+// when the row comes back into the cache
+editorRenderSlot* editorRowCheckpoints(editorRow *row) {
+    bool fresh;
+    editorRenderSlot *slot = editorRowSlot(row, &fresh);
+    if (fresh || !slot->windowed)
+    {
+        editorBuildCheckpoints(row, slot);
+        slot->windowed = true;
+        slot->windowEnd = -1;
+    }
+    return slot;
+}
+
+// A long row changed at `at`, where `removed` bytes made way for `added` new ones. The block the
+// edit fell in is walked again (and split up if it grew too big), the checkpoints after it move
+// along. The change in columns only has to be worked out again at the first block with a tab
+// after the edit, past that it's a whole number of tab stops and the tabs keep it as it is
+void editorPatchCheckpoints(editorRow *row, int at, int removed, int added) {
+    editorRenderSlot *slot = &editor.renderCache[row->renderSlot];
+    if (row->renderStamp == 0 || slot->stamp != row->renderStamp || !slot->windowed)
+    {
+        row->renderStamp = 0;
+        return;
+    }
+    slot->windowEnd = -1;
+
+    // The walk starts far enough back to catch a character the edit joined onto, checkpoints
+    // from there through the removed bytes go and the ones after move along with their text
+    int j = editorLastCheckpoint(slot, at > 3 ? at - 4 : 0, false);
+    int gone = j + 1;
+    while (gone < slot->numCheckpoints && slot->checkpoints[gone].cx <= at + removed) gone++;
+    memmove(&slot->checkpoints[j + 1], &slot->checkpoints[gone],
+        sizeof(editorLineCheckpoint) * (slot->numCheckpoints - gone));
+    slot->numCheckpoints -= gone - j - 1;
+    for (int i = j + 1; i < slot->numCheckpoints; i++) slot->checkpoints[i].cx += added - removed;
+
+    int end = j + 1 < slot->numCheckpoints ? slot->checkpoints[j + 1].cx : row->size;
+    int cx = slot->checkpoints[j].cx;
+    int rx = slot->checkpoints[j].rx;
+    int blockStart = cx;
+    bool tabs = false;
+    while (cx < end)
+    {
+        if (cx - blockStart >= ZTEXT_LINE_CHECKPOINT)
+        {
+            slot->checkpoints[j].tabs = tabs;
+            editorAddCheckpoint(slot, ++j, cx, rx);
+            blockStart = cx;
+            tabs = false;
+        }
+
+        int columns;
+        if (row->chars[cx] == '\t') tabs = true;
+        cx += editorCharColumns(row, cx, rx, &columns);
+        rx += columns;
+    }
+    slot->checkpoints[j].tabs = tabs;
+
+    int next = j + 1;
+    if (next == slot->numCheckpoints) return;
+    if (cx != end)
+    {
+        // The edit made a character out of bytes on both sides of the next checkpoint
+        editorBuildCheckpoints(row, slot);
+        return;
+    }
+
+    int shift = rx - slot->checkpoints[next].rx;
+    slot->checkpoints[next].rx = rx;
+    for (int i = next + 1; i < slot->numCheckpoints && shift != 0; i++) {
+        editorLineCheckpoint *block = &slot->checkpoints[i - 1];
+        if (block->tabs && shift % ZTEXT_TAB_STOP != 0)
+        {
+            int blockCx = block->cx;
+            int blockRx = block->rx;
+            while (blockCx < slot->checkpoints[i].cx)
+            {
+                int columns;
+                blockCx += editorCharColumns(row, blockCx, blockRx, &columns);
+                blockRx += columns;
+            }
+            shift = blockRx - slot->checkpoints[i].rx;
+        }
+        slot->checkpoints[i].rx += shift;
+    }
+}
+
+// The row changed at `at`, where `removed` bytes made way for `added` new ones. Long rows only
+// look at what changed, everything else goes through a full editorUpdateRow()
+void editorRowChanged(editorRow *row, int at, int removed, int added) {
+    if (row->size < ZTEXT_LONG_LINE)
+    {
+        editorUpdateRow(row);
+        return;
+    }
+
+    // Flags only ever get set here, a stale one costs a little speed and nothing else
+    row->flags |= editorScanText(&row->chars[at], added);
+    editorPatchCheckpoints(row, at, removed, added);
+}
+
+void editorInsertRow(int at, const char *s, size_t len) {
+    if (at < 0 || at > editor.numRows) return;
+    editorUndoRecord(UNDO_INSERT_ROWS, at, 0, s, len);
+
+    editorRow *row = editorOpenRowSlot(at);
+
+    // The new row starts out leaving open whatever it inherits, so rows below only
+    // need another look if its own text changes that
+    if (at < editor.hlFrontier)
+    {
+        editor.hlFrontier++;
+        row->hlOpen = at ? editorRowAt(at - 1)->hlOpen : 0;
+    }
+
+    row->size = len;
+    row->capacity = len + 1 < ZTEXT_ROW_MIN_CAPACITY ? ZTEXT_ROW_MIN_CAPACITY : len + 1;
+    row->flags = 0;
+    row->chars = malloc(row->capacity);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->renderSlot = 0;
+    row->renderStamp = 0;
+    editorUpdateRow(row);
+    editorHighlightChanged(at);
+
+    editor.version++;
+    if (!editor.stinky) {
+        editor.stinky = true;
+    }
+}
+
+void editorRowInsertChar(int y, int at, int c) {
+    char ch = c;
+    editorRowInsertString(y, at, &ch, 1);
+}
+
+void editorRowInsertString(int y, int at, const char *s, size_t len) {
+    if (len == 0) return;
+    editorRow *row = editorRowForEdit(y);
+    if (at < 0 || at > row->size) at = row->size;
+    editorUndoRecord(UNDO_INSERT_CHARS, y, at, s, len);
+
+    editorRowReserve(row, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    editorRowChanged(row, at, 0, len);
+    editorHighlightChanged(y);
+
+    editor.version++;
+    if (!editor.stinky) {
+        editor.stinky = true;
+    }
+}
+
+void editorFreeRow(editorRow *row) {
+    if (!(row->flags & ZTEXT_ROW_ARENA_CHARS)) free(row->chars);
+}
+
+// Grows chars geometrically, rows still sitting in the arena move out to the heap on their first growth
+void editorRowReserve(editorRow *row, int needed) {
+    if (needed <= row->capacity) return;
+
+    int capacity = row->capacity * 2;
+    if (capacity < needed) capacity = needed;
+    if (capacity < ZTEXT_ROW_MIN_CAPACITY) capacity = ZTEXT_ROW_MIN_CAPACITY;
+
+    if (row->flags & ZTEXT_ROW_ARENA_CHARS)
+    {
+        char *chars = malloc(capacity);
+        if (chars == NULL) printEditorError("Cannot allocate row");
+        memcpy(chars, row->chars, row->size + 1);
+        row->chars = chars;
+        row->flags &= ~ZTEXT_ROW_ARENA_CHARS;
+    }else
+    {
+        row->chars = realloc(row->chars, capacity);
+        if (row->chars == NULL) printEditorError("Cannot allocate row");
+    }
+    row->capacity = capacity;
+}
+
+void editorDelRow(int at) {
+    editorDelRows(at, 1);
+}
+
+// Deletes count rows from `at` on. Chunks emptied along the way are dropped all together,
+// so taking out a big block costs about as much as freeing its rows
+void editorDelRows(int at, int count) {
+    if (at < 0 || at >= editor.numRows) return;
+    if (count > editor.numRows - at) count = editor.numRows - at;
+    if (count <= 0) return;
+
+    int offset;
+    int c = editorFindChunk(at, &offset);
+
+    if (!editor.undoReplaying || editor.journal.enabled)
+    {
+        int chunk = c;
+        int j = offset;
+        for (int i = 0; i < count; i++) {
+            editorRow *row = &editor.chunks[chunk]->rows[j];
+            editorUndoRecord(UNDO_DELETE_ROWS, at, 0, row->chars, row->size);
+            if (++j == editor.chunks[chunk]->count)
+            {
+                chunk++;
+                j = 0;
+            }
+        }
+    }
+
+    int removeFrom = -1;
+    int removeCount = 0;
+    int left = count;
+    for (int i = c; left > 0; i++) {
+        editorRowChunk *chunk = editor.chunks[i];
+        int n = chunk->count - offset < left ? chunk->count - offset : left;
+
+        if (n == chunk->count)
+        {
+            editorReleaseChunks(&editor.chunks[i], 1);
+            if (removeFrom == -1) removeFrom = i;
+            removeCount++;
+        }else
+        {
+            chunk = editorChunkForEdit(i);
+            for (int j = offset; j < offset + n; j++) editorFreeRow(&chunk->rows[j]);
+            memmove(&chunk->rows[offset], &chunk->rows[offset + n],
+                sizeof(editorRow) * (chunk->count - offset - n));
+            chunk->count -= n;
+            editorChunkIndexAdd(i, -n);
+        }
+
+        left -= n;
+        offset = 0;
+    }
+    editor.numRows -= count;
+
+    bool rebuild = false;
+    if (removeCount)
+    {
+        memmove(&editor.chunks[removeFrom], &editor.chunks[removeFrom + removeCount],
+            sizeof(editorRowChunk *) * (editor.numChunks - removeFrom - removeCount));
+        editor.numChunks -= removeCount;
+        rebuild = true;
+    }
+
+    // Fold sparse neighbours back together so the chunk list doesn't fragment
+    int m = removeFrom == c ? c - 1 : c;
+    if (m >= 0 && m + 1 < editor.numChunks &&
+        editor.chunks[m]->count + editor.chunks[m + 1]->count <= ZTEXT_CHUNK_ROWS / 2)
+    {
+        editorRowChunk *chunk = editorChunkForEdit(m);
+        editorRowChunk *next = editorChunkForEdit(m + 1);
+        memcpy(&chunk->rows[chunk->count], next->rows, sizeof(editorRow) * next->count);
+        chunk->count += next->count;
+        free(next);
+        memmove(&editor.chunks[m + 1], &editor.chunks[m + 2],
+            sizeof(editorRowChunk *) * (editor.numChunks - m - 2));
+        editor.numChunks--;
+        rebuild = true;
+    }
+    if (rebuild) editorRebuildChunkIndex();
+
+    if (at < editor.hlFrontier) editor.hlFrontier -= count < editor.hlFrontier - at ? count : editor.hlFrontier - at;
+    editorHighlightChanged(at);
+
+    editor.version++;
+    if (!editor.stinky) {
+        editor.stinky = true;
+    }
+}
+
+void editorRowDelChar(int y, int at) {
+    editorRowDelChars(y, at, 1);
+}
+
+void editorRowDelChars(int y, int at, int len) {
+    editorRow *row = editorRowForEdit(y);
+    if (at < 0 || at >= row->size || len <= 0) return;
+    if (len > row->size - at) len = row->size - at;
+    editorUndoRecord(UNDO_DELETE_CHARS, y, at, &row->chars[at], len);
+
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    editorRowChanged(row, at, len, 0);
+    editorHighlightChanged(y);
+
+    editor.version++;
+    if (!editor.stinky) {
+        editor.stinky = true;
+    }
+}
+
+void editorRowAppendString(int y, const char *s, size_t len) {
+    editorRowInsertString(y, editorRowAt(y)->size, s, len);
+}
+
+// Syntax highlighting
+
+// Every row keeps only what it leaves open at its end (hlOpen). Rows above hlFrontier have that
+// worked out, the rest get it the first time something below them is drawn. The colors
+// themselves live next to the render in the render cache, so only rows on screen carry them
+
+bool isSeparator(int c) {
+    return isspace((unsigned char)c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}", c) != NULL;
+}
+
+// Highlights a line starting in state, writing a highlight per byte into hl, and returns the
+// state it leaves for the next line: 0, HL_OPEN_COMMENT or the quote of a string that carries on.
+// Without hl only that end state is worked out, numbers and keywords can't change it
+unsigned char editorHighlightText(const char *text, int length, unsigned char state, unsigned char *hl) {
+    struct editorSyntax *syntax = editor.syntax;
+    char *scs = syntax->singleLineCommentStart;
+    char *mcs = syntax->multiLineCommentStart;
+    char *mce = syntax->multiLineCommentEnd;
+    int scsLength = scs ? strlen(scs) : 0;
+    int mcsLength = mcs ? strlen(mcs) : 0;
+    int mceLength = mce ? strlen(mce) : 0;
+
+    if (hl) memset(hl, HL_NORMAL, length);
+
+    bool prevSeparator = true;
+    bool continued = false;
+    int i = 0;
+    while (i < length)
+    {
+        char c = text[i];
+
+        if (state == HL_OPEN_COMMENT)
+        {
+            if (mceLength && c == mce[0] && i + mceLength <= length && !memcmp(&text[i], mce, mceLength))
+            {
+                if (hl) memset(&hl[i], HL_MLCOMMENT, mceLength);
+                i += mceLength;
+                state = 0;
+                prevSeparator = true;
+            }else
+            {
+                if (hl) hl[i] = HL_MLCOMMENT;
+                i++;
+            }
+            continue;
+        }
+
+        if (state)
+        {
+            if (hl) hl[i] = HL_STRING;
+            if (c == '\\')
+            {
+                if (i + 1 == length)
+                {
+                    continued = true;
+                }else if (hl)
+                {
+                    hl[i + 1] = HL_STRING;
+                }
+                i += 2;
+                continue;
+            }
+            if (c == state) state = 0;
+            i++;
+            prevSeparator = true;
+            continue;
+        }
+
+        if (scsLength && c == scs[0] && i + scsLength <= length && !memcmp(&text[i], scs, scsLength))
+        {
+            if (hl) memset(&hl[i], HL_COMMENT, length - i);
+            break;
+        }
+
+        if (mcsLength && c == mcs[0] && i + mcsLength <= length && !memcmp(&text[i], mcs, mcsLength))
+        {
+            if (hl) memset(&hl[i], HL_MLCOMMENT, mcsLength);
+            i += mcsLength;
+            state = HL_OPEN_COMMENT;
+            continue;
+        }
+
+        if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\''))
+        {
+            if (hl) hl[i] = HL_STRING;
+            state = c;
+            i++;
+            continue;
+        }
+
+        if (hl == NULL)
+        {
+            i++;
+            continue;
+        }
+
+        unsigned char prevHl = i > 0 ? hl[i - 1] : HL_NORMAL;
+        if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) &&
+            ((isdigit((unsigned char)c) && (prevSeparator || prevHl == HL_NUMBER)) || (c == '.' && prevHl == HL_NUMBER)))
+        {
+            hl[i++] = HL_NUMBER;
+            prevSeparator = false;
+            continue;
+        }
+
+        if (prevSeparator)
+        {
+            int k;
+            for (k = 0; syntax->keywords[k]; k++) {
+                int keywordLength = strlen(syntax->keywords[k]);
+                bool type = syntax->keywords[k][keywordLength - 1] == '|';
+                if (type) keywordLength--;
+
+                if (i + keywordLength <= length && !memcmp(&text[i], syntax->keywords[k], keywordLength) &&
+                    (i + keywordLength == length || isSeparator(text[i + keywordLength])))
+                {
+                    memset(&hl[i], type ? HL_KEYWORD2 : HL_KEYWORD1, keywordLength);
+                    i += keywordLength;
+                    break;
+                }
+            }
+            if (syntax->keywords[k] != NULL)
+            {
+                prevSeparator = false;
+                continue;
+            }
+        }
+
+        prevSeparator = isSeparator(c);
+        i++;
+    }
+
+    // A string only runs on into the next line when the line ends in a backslash
+    if (state != 0 && state != HL_OPEN_COMMENT && !continued) state = 0;
+    return state;
+}
+
+// End state of a row starting in state. Rows past ZTEXT_LONG_LINE go without colors
+// and hand on the state they start in, rather than have every edit walk them whole
+unsigned char editorHighlightRow(editorRow *row, unsigned char state) {
+    if (row->size >= ZTEXT_LONG_LINE) return state;
+    return editorHighlightText(row->chars, row->size, state, NULL);
+}
+
+// The state row `at` starts in. Works out the end state of every row above it that
+// doesn't have one yet, which is the only place highlighting walks offscreen rows
+unsigned char editorHighlightStart(int at) {
+    if (at == 0) return 0;
+
+    if (editor.hlFrontier < at)
+    {
+        int offset;
+        int c = editorFindChunk(editor.hlFrontier, &offset);
+        unsigned char state = editor.hlFrontier ? editorRowAt(editor.hlFrontier - 1)->hlOpen : 0;
+
+        for (int i = editor.hlFrontier; i < at; i++) {
+            editorRow *row = &editor.chunks[c]->rows[offset];
+            state = row->hlOpen = editorHighlightRow(row, state);
+            if (++offset == editor.chunks[c]->count)
+            {
+                c++;
+                offset = 0;
+            }
+        }
+        editor.hlFrontier = at;
+    }
+
+    return editorRowAt(at - 1)->hlOpen;
+}
+
+// Row `at` was edited, inserted or took the place of a deleted one. Its end state is redone,
+// and so is the next row's for as long as they keep coming out different. Past the bottom
+// of the screen the frontier is pulled back instead and the rest is left for later
+void editorHighlightChanged(int at) {
+    if (editor.syntax == NULL || at >= editor.hlFrontier || at >= editor.numRows) return;
+
+    int bottom = editor.rowOffset + editor.terminalRows;
+    unsigned char state = editorHighlightStart(at);
+    int offset;
+    int c = editorFindChunk(at, &offset);
+
+    for (int i = at; i < editor.hlFrontier; i++) {
+        editorRow *row = &editor.chunks[c]->rows[offset];
+        unsigned char end = editorHighlightRow(row, state);
+        if (end == row->hlOpen) return;
+
+        row->hlOpen = state = end;
+        if (i >= bottom)
+        {
+            editor.hlFrontier = i + 1;
+            return;
+        }
+        if (++offset == editor.chunks[c]->count)
+        {
+            c++;
+            offset = 0;
+        }
+    }
+}
+
+// Render and colors of row `at`. The colors are cached in the render slot and only
+// redone when the row changed or now starts in a different state
+unsigned char* editorRowHighlight(int at, char **render, int *length) {
+    editorRow *row = editorRowAt(at);
+    int start = editorHighlightStart(at);
+    *render = editorRowRender(row, length);
+    editorRenderSlot *slot = &editor.renderCache[row->renderSlot];
+
+    if (slot->hlStart != start)
+    {
+        if (*length + 1 > slot->hlCapacity)
+        {
+            int capacity = slot->hlCapacity ? slot->hlCapacity : ZTEXT_ROW_MIN_CAPACITY;
+            while (capacity < *length + 1) capacity *= 2;
+            slot->hl = realloc(slot->hl, capacity);
+            if (slot->hl == NULL) printEditorError("Cannot allocate highlight");
+            slot->hlCapacity = capacity;
+            editor.allocations++;
+        }
+
+        unsigned char end = editorHighlightText(*render, *length, start, slot->hl);
+        slot->hlStart = start;
+        if (at == editor.hlFrontier)
+        {
+            row->hlOpen = end;
+            editor.hlFrontier++;
+        }
+    }
+
+    return slot->hl;
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl)
+    {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        default: return 39;
+    }
+}
+
+void editorSelectSyntaxHighlight() {
+    editor.syntax = NULL;
+    editor.hlFrontier = 0;
+    for (int i = 0; i < ZTEXT_RENDER_CACHE_SLOTS; i++) editor.renderCache[i].hlStart = -1;
+    if (editor.fileName == NULL) return;
+
+    char *ext = strrchr(editor.fileName, '.');
+
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *syntax = &HLDB[j];
+        for (int i = 0; syntax->fileMatch[i]; i++) {
+            bool isExt = syntax->fileMatch[i][0] == '.';
+            if ((isExt && ext && !strcmp(ext, syntax->fileMatch[i])) ||
+                (!isExt && strstr(editor.fileName, syntax->fileMatch[i])))
+            {
+                editor.syntax = syntax;
+                return;
+            }
+        }
+    }
+}
+
+// Editor operations
+
+// The row past the end is only the end once the whole file is in. Merged chunks go after
+// the last row, so a row typed there before then would end up in the middle of the file
+void editorFinishLoadAtEnd(){
+    if (editor.cy != editor.numRows || !editor.load.running) return;
+    editorFinishLoad();
+    editor.cy = editor.numRows;
+    editor.cx = 0;
+}
+
+void editorInsertChar(int c){
+    editorFinishLoadAtEnd();
+    if (editor.cy == editor.numRows) editorInsertRow(editor.numRows,"", 0);
+    editorRowInsertChar(editor.cy, editor.cx, c);
+    editor.cx++;
+}
+
+void editorInsertNewLine() {
+    editorFinishLoadAtEnd();
+    if (editor.cx == 0)
+    {
+        editorInsertRow(editor.cy, "", 0);
+    }else
+    {
+        editorRow *row = editorRowAt(editor.cy);
+        editorInsertRow(editor.cy + 1, &row->chars[editor.cx], row->size - editor.cx);
+        row = editorRowAt(editor.cy);
+        editorRowDelChars(editor.cy, editor.cx, row->size - editor.cx);
+    }
+    editor.cy++;
+    editor.cx = 0;
+}
+
+void editorDelChar() {
+    if (editor.cy == editor.numRows) return;
+    if (editor.cx == 0 && editor.cy == 0) return;
+
+    if (editor.cx > 0)
+    {
+        int from = editorRowPrevChar(editorRowAt(editor.cy), editor.cx);
+        editorRowDelChars(editor.cy, from, editor.cx - from);
+        editor.cx = from;
+    }else
+    {
+        editorRow *row = editorRowAt(editor.cy);
+        editor.cx = editorRowAt(editor.cy - 1)->size;
+        editorRowAppendString(editor.cy - 1, row->chars, row->size);
+        editorDelRow(editor.cy);
+        editor.cy--;
+    }
+}
+
+// Inserts a block of text at the cursor in one go, line breaks may be \r, \n or \r\n
+void editorInsertText(const char *s, size_t len) {
+    if (len == 0) return;
+    editorFinishLoadAtEnd();
+    if (editor.cy == editor.numRows) editorInsertRow(editor.numRows, "", 0);
+
+    // Whatever sat right of the cursor ends up after the last pasted line
+    editorRow *row = editorRowAt(editor.cy);
+    int tailLength = row->size - editor.cx;
+    char *tail = malloc(tailLength + 1);
+    memcpy(tail, &row->chars[editor.cx], tailLength);
+    editorRowDelChars(editor.cy, editor.cx, tailLength);
+
+    const char *end = s + len;
+    bool first = true;
+
+    while (true)
+    {
+        const char *p = s;
+        while (p < end && *p != '\r' && *p != '\n') p++;
+
+        if (first)
+        {
+            editorRowAppendString(editor.cy, s, p - s);
+            first = false;
+        }else
+        {
+            editor.cy++;
+            editorInsertRow(editor.cy, s, p - s);
+        }
+
+        if (p == end) break;
+        if (*p == '\r' && p + 1 < end && p[1] == '\n') p++;
+        s = p + 1;
+    }
+
+    editor.cx = editorRowAt(editor.cy)->size;
+    editorRowAppendString(editor.cy, tail, tailLength);
+    free(tail);
+}
+
+// Collects a bracketed paste up to its closing marker and inserts it as a single block
+void editorPaste() {
+    static const char marker[] = "\x1b[201~";
+    const int markerLength = sizeof(marker) - 1;
+
+    struct appendBuffer paste = ABUF_INIT;
+
+    while (true)
+    {
+        if (!fillInput(-1)) continue;
+
+        // Take the whole input buffer at once, the marker may straddle two reads
+        int from = paste.len > markerLength ? paste.len - markerLength + 1 : 0;
+        abAppend(&paste, &editor.input[editor.inputStart], editor.inputLength);
+        editor.inputStart += editor.inputLength;
+        editor.inputLength = 0;
+
+        char *found = memmem(&paste.b[from], paste.len - from, marker, markerLength);
+        if (found)
+        {
+            // Anything typed after the paste goes back to the input buffer
+            int end = found - paste.b;
+            int extra = paste.len - end - markerLength;
+            editor.inputStart -= extra;
+            editor.inputLength = extra;
+            paste.len = end;
+            break;
+        }
+    }
+
+    editorInsertText(paste.b, paste.len);
+    abFree(&paste);
+}
+
+// Undo functions
+
+// Logs a primitive edit, merging it into the last entry when it just carries that one on:
+// typing and deleting along a row, or rows going in or out one after another in the same step
+void editorUndoRecord(int type, int y, int x, const char *s, int len) {
+    // Undo and redo are edits like any other as far as the file is concerned
+    editorJournalRecord(type, y, x, s, len);
+    editorFollowEdited(y);
+    if (editor.undoReplaying || editor.undoGroup == editor.undoSkipGroup) return;
+    editorUndoDropRedo();
+
+    editorUndoOp *top = editor.undoCount ? &editor.undoOps[editor.undoCount - 1] : NULL;
+    if (top && top->type == type)
+    {
+        // Typing runs carry on across keys, as long as nothing else happened in between
+        bool recent = top->group + 1 >= editor.undoGroup;
+        bool sameGroup = top->group == editor.undoGroup;
+        bool typing = (type == UNDO_INSERT_CHARS && x == top->x + top->length) ||
+                      (type == UNDO_DELETE_CHARS && (x == top->x || x + len == top->x));
+
+        if (recent && top->y == y && typing)
+        {
+            // Move the run, and whatever else its first key did, up to this key
+            for (int i = editor.undoCount - 1; i >= 0 && editor.undoOps[i].group == top->group; i--) {
+                if (i < editor.undoCount - 1) editor.undoOps[i].group = editor.undoGroup;
+            }
+            top->group = editor.undoGroup;
+
+            bool front = type == UNDO_DELETE_CHARS && x != top->x;
+            top->x = type == UNDO_DELETE_CHARS ? x : top->x;
+            editorUndoAppend(top, s, len, front);
+            editorUndoTrim();
+            return;
+        }
+        if ((type == UNDO_INSERT_ROWS && sameGroup && y == top->y + top->rows) ||
+            (type == UNDO_DELETE_ROWS && sameGroup && y == top->y))
+        {
+            editorUndoAppend(top, "\n", 1, false);
+            editorUndoAppend(top, s, len, false);
+            top->rows++;
+            editorUndoTrim();
+            return;
+        }
+    }
+
+    if (editor.undoCount == editor.undoCapacity)
+    {
+        editor.undoCapacity = editor.undoCapacity ? editor.undoCapacity * 2 : 64;
+        editor.undoOps = realloc(editor.undoOps, sizeof(editorUndoOp) * editor.undoCapacity);
+        if (editor.undoOps == NULL) printEditorError("Cannot allocate undo log");
+    }
+
+    editorUndoOp *op = &editor.undoOps[editor.undoCount++];
+    op->type = type;
+    op->y = y;
+    op->x = x;
+    op->rows = 1;
+    op->text = NULL;
+    op->length = 0;
+    op->capacity = 0;
+    op->group = editor.undoGroup;
+    editor.undoCursor = editor.undoCount;
+    editor.undoBytes += sizeof(editorUndoOp);
+
+    editorUndoAppend(op, s, len, false);
+    editorUndoTrim();
+}
+
+void editorUndoAppend(editorUndoOp *op, const char *s, int len, bool front) {
+    if (len == 0) return;
+    if (op->length + len > op->capacity)
+    {
+        int capacity = op->capacity ? op->capacity * 2 : ZTEXT_ROW_MIN_CAPACITY;
+        while (capacity < op->length + len) capacity *= 2;
+        op->text = realloc(op->text, capacity);
+        if (op->text == NULL) printEditorError("Cannot allocate undo log");
+        editor.undoBytes += capacity - op->capacity;
+        op->capacity = capacity;
+    }
+
+    if (front)
+    {
+        memmove(&op->text[len], op->text, op->length);
+        memcpy(op->text, s, len);
+    }else
+    {
+        memcpy(&op->text[op->length], s, len);
+    }
+    op->length += len;
+}
+
+// Drops the oldest steps until the log fits the budget again. If the step being recorded
+// doesn't fit on its own the whole history goes, along with whatever is left of that step
+void editorUndoTrim() {
+    while (editor.undoBytes > editor.undoBudget && editor.undoCount > 0)
+    {
+        unsigned long group = editor.undoOps[0].group;
+        if (group == editor.undoGroup)
+        {
+            editorUndoClear();
+            editor.undoSkipGroup = group;
+            return;
+        }
+
+        int n = 0;
+        while (n < editor.undoCount && editor.undoOps[n].group == group) {
+            editor.undoBytes -= editor.undoOps[n].capacity + sizeof(editorUndoOp);
+            free(editor.undoOps[n].text);
+            n++;
+        }
+        memmove(editor.undoOps, &editor.undoOps[n], sizeof(editorUndoOp) * (editor.undoCount - n));
+        editor.undoCount -= n;
+        editor.undoCursor -= n;
+    }
+}
+
+// A fresh edit makes whatever was undone unreachable
+void editorUndoDropRedo() {
+    for (int i = editor.undoCursor; i < editor.undoCount; i++) {
+        editor.undoBytes -= editor.undoOps[i].capacity + sizeof(editorUndoOp);
+        free(editor.undoOps[i].text);
+    }
+    editor.undoCount = editor.undoCursor;
+}
+
+void editorUndoClear() {
+    editor.undoCursor = 0;
+    editorUndoDropRedo();
+}
+
+// Applies an entry backwards (undo) or forwards (redo) through the same primitives that
+// recorded it, and leaves the cursor where the change happened
+void editorUndoApply(editorUndoOp *op, bool undo) {
+    bool insert = (op->type == UNDO_INSERT_CHARS || op->type == UNDO_INSERT_ROWS) != undo;
+
+    editor.cy = op->y;
+    if (op->type == UNDO_INSERT_CHARS || op->type == UNDO_DELETE_CHARS)
+    {
+        if (insert)
+        {
+            editorRowInsertString(op->y, op->x, op->text, op->length);
+            editor.cx = op->x + op->length;
+        }else
+        {
+            editorRowDelChars(op->y, op->x, op->length);
+            editor.cx = op->x;
+        }
+        return;
+    }
+
+    editor.cx = 0;
+    if (insert)
+    {
+        const char *p = op->text ? op->text : "";
+        const char *end = p + op->length;
+        for (int i = 0; i < op->rows; i++) {
+            const char *newline = memchr(p, '\n', end - p);
+            if (newline == NULL) newline = end;
+            editorInsertRow(op->y + i, p, newline - p);
+            p = newline + 1;
+        }
+    }else
+    {
+        editorDelRows(op->y, op->rows);
+    }
+}
+
+void editorUndo() {
+    if (editor.undoCursor == 0)
+    {
+        setStatusMessage("Nothing to undo");
+        return;
+    }
+
+    unsigned long group = editor.undoOps[editor.undoCursor - 1].group;
+    editor.undoReplaying = true;
+    while (editor.undoCursor > 0 && editor.undoOps[editor.undoCursor - 1].group == group) {
+        editorUndoApply(&editor.undoOps[--editor.undoCursor], true);
+    }
+    editor.undoReplaying = false;
+
+    editorRow *row = editorRowAt(editor.cy);
+    int rowLength = row ? row->size : 0;
+    if (editor.cx > rowLength) editor.cx = rowLength;
+}
+
+void editorRedo() {
+    if (editor.undoCursor == editor.undoCount)
+    {
+        setStatusMessage("Nothing to redo");
+        return;
+    }
+
+    unsigned long group = editor.undoOps[editor.undoCursor].group;
+    editor.undoReplaying = true;
+    while (editor.undoCursor < editor.undoCount && editor.undoOps[editor.undoCursor].group == group) {
+        editorUndoApply(&editor.undoOps[editor.undoCursor++], false);
+    }
+    editor.undoReplaying = false;
+
+    editorRow *row = editorRowAt(editor.cy);
+    int rowLength = row ? row->size : 0;
+    if (editor.cx > rowLength) editor.cx = rowLength;
+}
+
+// Search functions
+
+void editorFind() {
+    int savedCx = editor.cx;
+    int savedCy = editor.cy;
+    int savedColumnOffset = editor.columnOffset;
+    int savedRowOffset = editor.rowOffset;
+
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+
+    if (query)
+    {
+        free(query);
+    }else
+    {
+        editor.cx = savedCx;
+        editor.cy = savedCy;
+        editor.columnOffset = savedColumnOffset;
+        editor.rowOffset = savedRowOffset;
+    }
+}
+
+// Runs after every key of the search prompt. Typing keeps the current match if it still
+// matches, the arrows move on to the next or previous row holding one
+void editorFindCallback(char *query, int key) {
+    static int lastMatch = -1;
+    static int direction = 1;
+
+    if (key == '\r' || key == '\x1b')
+    {
+        lastMatch = -1;
+        direction = 1;
+        return;
+    }
+
+    size_t queryLength = strlen(query);
+    if (queryLength == 0 || editor.numRows == 0) return;
+
+    int from;
+    if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    {
+        direction = 1;
+        from = lastMatch == -1 ? editor.cy : lastMatch + 1;
+    }else if (key == ARROW_LEFT || key == ARROW_UP)
+    {
+        direction = -1;
+        from = lastMatch == -1 ? editor.cy : lastMatch - 1;
+    }else
+    {
+        direction = 1;
+        from = lastMatch == -1 ? editor.cy : lastMatch;
+    }
+
+    if (from < 0) from = editor.numRows - 1;
+    if (from >= editor.numRows) from = 0;
+
+    int column;
+    int match = editorSearchRows(query, queryLength, from, direction, &column);
+    if (match == -1) return;
+
+    lastMatch = match;
+    editor.cy = match;
+    editor.cx = column;
+    // Past the end on purpose, editorScroll() then brings the match to the top of the screen
+    editor.rowOffset = editor.numRows;
+}
+
+// Looks for query starting at row `from` and going in `direction`, wrapping around the ends
+// of the buffer. Returns the first row holding it (column set to where it starts) or -1
+int editorSearchRows(const char *query, size_t queryLength, int from, int direction, int *column) {
+    int offset;
+    int c = editorFindChunk(from, &offset);
+    int chunkStart = from - offset;
+
+    if (direction > 0)
+    {
+        // One more lap than there are chunks, to come back round to the rows above `from`
+        for (int scanned = 0; scanned <= editor.numChunks; scanned++) {
+            int match = editorSearchChunk(editor.chunks[c], offset, query, queryLength, column);
+            if (match != -1) return chunkStart + match;
+
+            chunkStart += editor.chunks[c]->count;
+            offset = 0;
+            if (++c == editor.numChunks)
+            {
+                c = 0;
+                chunkStart = 0;
+            }
+        }
+        return -1;
+    }
+
+    for (int at = from, scanned = 0; scanned < editor.numRows; scanned++) {
+        editorRow *row = &editor.chunks[c]->rows[offset];
+        const char *match = editorMemSearch(row->chars, row->size, query, queryLength);
+        if (match)
+        {
+            *column = match - row->chars;
+            return at;
+        }
+
+        at--;
+        if (--offset < 0 && --c >= 0) offset = editor.chunks[c]->count - 1;
+        if (at < 0)
+        {
+            at = editor.numRows - 1;
+            c = editor.numChunks - 1;
+            offset = editor.chunks[c]->count - 1;
+        }
+    }
+
+    return -1;
+}
+
+// Rows loaded together sit back to back in the arena, each one followed by its '\0'. A query
+// never holds a '\0', so a run of such rows is searched as one block without any match
+// straddling two rows, which spares a call per row on files full of short lines. Blocks start
+// at a single row and double while nothing turns up, so a match close by doesn't cost walking
+// the rows of a whole block past it, and finding every match in a dense chunk stays linear.
+// Returns the offset in the chunk of the first row from `offset` on holding query, or -1
+int editorSearchChunk(editorRowChunk *chunk, int offset, const char *query, size_t queryLength, int *column) {
+    long block = 0;
+    while (offset < chunk->count)
+    {
+        const char *start = chunk->rows[offset].chars;
+        const char *stop = start + chunk->rows[offset].size + 1;
+        int end = offset + 1;
+        while (end < chunk->count && chunk->rows[end].chars == stop && stop - start < block)
+        {
+            stop += chunk->rows[end].size + 1;
+            end++;
+        }
+
+        const char *match = editorMemSearch(start, stop - start, query, queryLength);
+        if (match)
+        {
+            while (match - chunk->rows[offset].chars > chunk->rows[offset].size) offset++;
+            *column = match - chunk->rows[offset].chars;
+            return offset;
+        }
+        offset = end;
+        block = block ? (block < ZTEXT_SEARCH_BLOCK ? block * 2 : block) : 64;
+    }
+
+    return -1;
+}
+
+void editorFindAll() {
+    editorSearchJob job = {0};
+    char *query = editorPrompt("Find all: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
+    job.query = query;
+    job.queryLength = strlen(query);
+
+    long long start = monotonicMs();
+    editorFinishLoad();
+    int rows;
+    int matches = editorCollectMatches(&job, &rows);
+    setStatusMessage("%d matches of \"%s\" in %d lines (%lld ms)", matches, query, rows, monotonicMs() - start);
+
+    editorFreeMatches(&job);
+    free(query);
+}
+
+// Finds every match on the pool first, then rewrites each affected row once, also on the pool
+void editorReplaceAll() {
+    char *query = editorPrompt("Replace all: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
+    char *replacement = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (replacement == NULL)
+    {
+        free(query);
+        return;
+    }
+
+    long long start = monotonicMs();
+    editorFinishLoad();
+    int rows;
+    int matches = editorReplaceText(query, replacement, &rows);
+    setStatusMessage("Replaced %d matches in %d lines (%lld ms)%s", matches, rows, monotonicMs() - start,
+        editor.undoSkipGroup == editor.undoGroup ? ", can't be undone" : "");
+
+    free(query);
+    free(replacement);
+}
+
+// Replaces every query in the buffer, matches are found and rewritten a chunk per worker.
+// Returns how many there were, *rows gets how many rows they were on
+int editorReplaceText(const char *query, const char *replacement, int *rows) {
+    editorSearchJob job = {0};
+    job.query = query;
+    job.queryLength = strlen(query);
+    job.replacement = replacement;
+    job.replacementLength = strlen(replacement);
+
+    int matches = editorCollectMatches(&job, rows);
+    if (matches > 0)
+    {
+        // Unsharing chunks touches the chunk list, so that part stays on this thread
+        int chunkStart = 0;
+        for (int c = 0; c < editor.numChunks; c++) {
+            if (job.matches[c].count)
+            {
+                editorChunkForEdit(c);
+                // Highlighting is redone lazily from the first row that changed
+                int first = chunkStart + job.matches[c].rows[0];
+                if (first < editor.hlFrontier) editor.hlFrontier = first;
+            }
+            chunkStart += editor.chunks[c]->count;
+        }
+
+        // Undo keeps the old and the new text of every row touched, unless that blows the budget
+        long long undoBytes = 0;
+        for (int c = 0; c < editor.numChunks; c++) {
+            editorMatchList *list = &job.matches[c];
+            for (int i = 0; i < list->count; i++) {
+                if (i == 0 || list->rows[i] != list->rows[i - 1]) undoBytes += 2 * editor.chunks[c]->rows[list->rows[i]].size;
+            }
+        }
+        undoBytes += (long long) matches * (job.replacementLength - job.queryLength);
+        bool undoable = undoBytes <= editor.undoBudget;
+        if (!undoable)
+        {
+            editorUndoClear();
+            editor.undoSkipGroup = editor.undoGroup;
+        }
+
+        editorMatchList *tail = &job.matches[editor.numChunks - 1];
+        if (tail->count && tail->rows[tail->count - 1] == editor.chunks[editor.numChunks - 1]->count - 1)
+            editorFollowEdited(editor.numRows - 1);
+
+        // The journal gets the replace itself, not every row it touched
+        editorJournalReplace(query, replacement);
+        bool suspended = editor.journal.suspended;
+        editor.journal.suspended = true;
+        if (undoable) editorUndoRecordReplace(&job, UNDO_DELETE_CHARS);
+        editorRunParallel(editorReplaceChunk, &job, editor.numChunks);
+        if (undoable) editorUndoRecordReplace(&job, UNDO_INSERT_CHARS);
+        editor.journal.suspended = suspended;
+
+        editor.version++;
+        if (!editor.stinky) {
+            editor.stinky = true;
+        }
+
+        editorRow *row = editorRowAt(editor.cy);
+        if (row && editor.cx > row->size) editor.cx = row->size;
+    }
+
+    editorFreeMatches(&job);
+    return matches;
+}
+
+// Logs every row holding a match as a whole-row delete (before the rewrite) or insert (after it)
+void editorUndoRecordReplace(editorSearchJob *job, int type) {
+    int chunkStart = 0;
+    for (int c = 0; c < editor.numChunks; c++) {
+        editorMatchList *list = &job->matches[c];
+        for (int i = 0; i < list->count; i++) {
+            if (i > 0 && list->rows[i] == list->rows[i - 1]) continue;
+            editorRow *row = &editor.chunks[c]->rows[list->rows[i]];
+            editorUndoRecord(type, chunkStart + list->rows[i], 0, row->chars, row->size);
+        }
+        chunkStart += editor.chunks[c]->count;
+    }
+}
+
+// Fills job->matches chunk by chunk on the pool, returns the total and the number of rows holding one
+int editorCollectMatches(editorSearchJob *job, int *rows) {
+    job->matches = calloc(editor.numChunks + 1, sizeof(editorMatchList));
+    editorRunParallel(editorMatchChunk, job, editor.numChunks);
+
+    int total = 0;
+    *rows = 0;
+    for (int c = 0; c < editor.numChunks; c++) {
+        editorMatchList *list = &job->matches[c];
+        total += list->count;
+        for (int i = 0; i < list->count; i++) {
+            if (i == 0 || list->rows[i] != list->rows[i - 1]) (*rows)++;
+        }
+    }
+    return total;
+}
+
+void editorFreeMatches(editorSearchJob *job) {
+    for (int c = 0; c < editor.numChunks; c++) {
+        free(job->matches[c].rows);
+        free(job->matches[c].columns);
+    }
+    free(job->matches);
+    job->matches = NULL;
+}
+
+// Records every non-overlapping match in chunk c
+void editorMatchChunk(int c, void *arg) {
+    editorSearchJob *job = arg;
+    editorRowChunk *chunk = editor.chunks[c];
+    editorMatchList *list = &job->matches[c];
+    int offset = 0;
+    int column;
+
+    while ((offset = editorSearchChunk(chunk, offset, job->query, job->queryLength, &column)) != -1)
+    {
+        editorRow *row = &chunk->rows[offset];
+        const char *match = row->chars + column;
+        do
+        {
+            if (list->count == list->capacity)
+            {
+                list->capacity = list->capacity ? list->capacity * 2 : 64;
+                list->rows = realloc(list->rows, sizeof(int) * list->capacity);
+                list->columns = realloc(list->columns, sizeof(int) * list->capacity);
+                if (list->rows == NULL || list->columns == NULL) printEditorError("Cannot allocate matches");
+            }
+            list->rows[list->count] = offset;
+            list->columns[list->count++] = match - row->chars;
+
+            const char *next = match + job->queryLength;
+            match = editorMemSearch(next, row->chars + row->size - next, job->query, job->queryLength);
+        } while (match);
+
+        offset++;
+    }
+}
+
+// Builds each row of chunk c that has matches anew, in a single buffer of the final size
+void editorReplaceChunk(int c, void *arg) {
+    editorSearchJob *job = arg;
+    editorRowChunk *chunk = editor.chunks[c];
+    editorMatchList *list = &job->matches[c];
+    int i = 0;
+
+    while (i < list->count)
+    {
+        editorRow *row = &chunk->rows[list->rows[i]];
+        int last = i;
+        while (last < list->count && list->rows[last] == list->rows[i]) last++;
+
+        int size = row->size + (last - i) * ((int) job->replacementLength - (int) job->queryLength);
+        char *chars = malloc(size + 1);
+        if (chars == NULL) printEditorError("Cannot allocate row");
+
+        int from = 0;
+        int to = 0;
+        for (; i < last; i++) {
+            memcpy(&chars[to], &row->chars[from], list->columns[i] - from);
+            to += list->columns[i] - from;
+            memcpy(&chars[to], job->replacement, job->replacementLength);
+            to += job->replacementLength;
+            from = list->columns[i] + job->queryLength;
+        }
+        memcpy(&chars[to], &row->chars[from], row->size - from);
+        chars[size] = '\0';
+
+        editorFreeRow(row);
+        row->chars = chars;
+        row->size = size;
+        row->capacity = size + 1;
+        row->flags &= ~ZTEXT_ROW_ARENA_CHARS;
+        editorUpdateRow(row);
+    }
+}
+
+// The middle of a candidate match. Most are a few bytes, too short to be worth a call to memcmp()
+bool editorMemEqual(const char *a, const char *b, size_t length) {
+    if (length > 16) return memcmp(a, b, length) == 0;
+    for (size_t i = 0; i < length; i++) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+// memmem() with a vector prefilter: compare the needle's first and last bytes against a whole
+// block of candidate positions at once, and only memcmp() the middle where both of them line up
+const char* editorMemSearch(const char *haystack, size_t length, const char *needle, size_t needleLength) {
+    if (needleLength == 0) return haystack;
+    if (needleLength > length) return NULL;
+    if (needleLength == 1) return memchr(haystack, needle[0], length);
+
+    size_t last = needleLength - 1;
+    size_t positions = length - last;
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const char *match = editorMemSearchAvx2(haystack, positions, needle, needleLength, &i);
+    if (match) return match;
+#elif defined(ZTEXT_AVX2)
+    if (positions >= 32 && __builtin_cpu_supports("avx2"))
+    {
+        const char *match = editorMemSearchAvx2(haystack, positions, needle, needleLength, &i);
+        if (match) return match;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i first16 = _mm_set1_epi8(needle[0]);
+    const __m128i last16 = _mm_set1_epi8(needle[last]);
+    while (i < positions && positions >= 16)
+    {
+        // The last block overlaps the previous one instead of leaving a scalar tail,
+        // the positions already looked at are masked off
+        size_t at = i + 16 <= positions ? i : positions - 16;
+        __m128i head = _mm_loadu_si128((const __m128i *)(haystack + at));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(haystack + at + last));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(head, first16), _mm_cmpeq_epi8(tail, last16)));
+        mask &= 0xffffu << (i - at);
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (editorMemEqual(haystack + at + bit + 1, needle + 1, needleLength - 2)) return haystack + at + bit;
+            mask &= mask - 1;
+        }
+        i = at + 16;
+    }
+#endif
+    for (; i < positions; i++) {
+        if (haystack[i] == needle[0] && haystack[i + last] == needle[last] &&
+            editorMemEqual(haystack + i + 1, needle + 1, needleLength - 2)) return haystack + i;
+    }
+
+    return NULL;
+}
+
+#ifdef ZTEXT_AVX2
+// editorMemSearch() 32 positions at a time. Returns the match, or NULL with *at moved on to
+// the positions it left for the narrower loops
+__attribute__((target("avx2")))
+const char* editorMemSearchAvx2(const char *haystack, size_t positions, const char *needle, size_t needleLength, size_t *at) {
+    size_t last = needleLength - 1;
+    size_t i = *at;
+    const __m256i first32 = _mm256_set1_epi8(needle[0]);
+    const __m256i last32 = _mm256_set1_epi8(needle[last]);
+    for (; i + 32 <= positions; i += 32)
+    {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(haystack + i + last));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(head, first32), _mm256_cmpeq_epi8(tail, last32)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (editorMemEqual(haystack + i + bit + 1, needle + 1, needleLength - 2)) return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    *at = i;
+    return NULL;
+}
+#endif
+
+// Batch mode
+
+// ztext --batch SCRIPT FILE... applies the script to every file, a process per file and as
+// many at once as there are cores, with no terminal at all. Scripts have a command per line:
+//
+//     goto N | goto N% | goto end    move to line N (or that far into the file, or past its end)
+//     insert TEXT                     new row above the cursor, which moves below it
+//     delete [N]                      delete N rows (1 by default) at the cursor
+//     replace /OLD/NEW/               replace OLD everywhere, any delimiter will do
+//     save                            write the file
+//
+// \t and \\ work in TEXT, OLD and NEW, so does a backslash before the delimiter. Blank lines
+// and lines starting with # are skipped
+
+int editorBatch(int argc, char *argv[]) {
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: ztext --batch SCRIPT FILE...\n");
+        return EXIT_FAILURE;
+    }
+
+    editorBatchScript script = {0};
+    if (!editorBatchParse(argv[0], &script)) return EXIT_FAILURE;
+    editor.batch = true;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int) cores : 1;
+    int files = argc - 1;
+    int next = 0;
+    int running = 0;
+    int failed = 0;
+
+    // Every file gets its own process, the cores left over go to their worker pools
+    editor.poolCores = workers / (files < workers ? files : workers);
+
+    while (next < files || running > 0)
+    {
+        if (next < files && running < workers)
+        {
+            pid_t pid = fork();
+            if (pid == 0) exit(editorBatchFile(&script, argv[1 + next]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+            if (pid != -1)
+            {
+                next++;
+                running++;
+                continue;
+            }
+            // Out of processes, wait for one to finish before trying again
+            if (running == 0)
+            {
+                perror("Cannot start batch worker");
+                return EXIT_FAILURE;
+            }
+        }
+
+        int status;
+        if (wait(&status) == -1) break;
+        running--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) failed++;
+    }
+
+    if (failed) fprintf(stderr, "ztext: %d of %d files failed\n", failed, files);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+bool editorBatchParse(const char *fileName, editorBatchScript *script) {
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL)
+    {
+        perror(fileName);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t length;
+    int lineNumber = 0;
+    const char *error = NULL;
+
+    while (error == NULL && (length = getline(&line, &lineCapacity, file)) != -1)
+    {
+        lineNumber++;
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        if (length == 0 || line[0] == '#') continue;
+
+        char *argument = strchr(line, ' ');
+        if (argument) *argument++ = '\0';
+        else argument = line + length;
+
+        editorBatchCommand command = {0};
+        if (strcmp(line, "goto") == 0)
+        {
+            char *end;
+            command.type = BATCH_GOTO;
+            if (strcmp(argument, "end") == 0)
+            {
+                command.line = LLONG_MAX;
+            }else
+            {
+                errno = 0;
+                command.line = strtoll(argument, &end, 10);
+                command.percent = *end == '%';
+                if (command.percent) end++;
+                if (end == argument || *end != '\0' || command.line < 0 || errno) error = "goto wants N, N% or end";
+            }
+        }else if (strcmp(line, "insert") == 0)
+        {
+            command.type = BATCH_INSERT;
+            char *end;
+            if (!editorBatchUnescape(argument, '\0', &end, &command.textLength)) error = "bad escape";
+            command.text = strndup(argument, command.textLength);
+        }else if (strcmp(line, "delete") == 0)
+        {
+            char *end;
+            command.type = BATCH_DELETE;
+            command.count = 1;
+            if (*argument)
+            {
+                long count = strtol(argument, &end, 10);
+                if (end == argument || *end != '\0' || count < 1 || count > INT_MAX) error = "delete wants a count of rows";
+                else command.count = count;
+            }
+        }else if (strcmp(line, "replace") == 0)
+        {
+            command.type = BATCH_REPLACE;
+            char delimiter = argument[0];
+            char *query = argument + 1;
+            char *replacement;
+            char *end;
+            if (delimiter == '\0' || !editorBatchUnescape(query, delimiter, &replacement, &command.textLength) ||
+                !editorBatchUnescape(replacement, delimiter, &end, &command.replacementLength) || *end != '\0')
+            {
+                error = "replace wants /OLD/NEW/";
+            }else if (command.textLength == 0)
+            {
+                error = "replace needs something to look for";
+            }else
+            {
+                command.text = strndup(query, command.textLength);
+                command.replacement = strndup(replacement, command.replacementLength);
+            }
+        }else if (strcmp(line, "save") == 0 && *argument == '\0')
+        {
+            command.type = BATCH_SAVE;
+        }else
+        {
+            error = "unknown command";
+        }
+
+        if (error == NULL)
+        {
+            script->commands = realloc(script->commands, sizeof(editorBatchCommand) * (script->count + 1));
+            if (script->commands == NULL) printEditorError("Cannot allocate script");
+            script->commands[script->count++] = command;
+        }
+    }
+
+    free(line);
+    fclose(file);
+    if (error)
+    {
+        fprintf(stderr, "%s:%d: %s\n", fileName, lineNumber, error);
+        return false;
+    }
+
+    script->streamable = editorBatchStreamable(script);
+    return true;
+}
+
+// Turns escapes into the characters they stand for, in place, up to an unescaped delimiter
+// (or the end of s). *end gets what follows the delimiter, false if it never showed up
+bool editorBatchUnescape(char *s, char delimiter, char **end, int *length) {
+    char *from = s;
+    char *to = s;
+
+    while (*from && *from != delimiter)
+    {
+        if (*from == '\\')
+        {
+            from++;
+            if (*from == 't') *to++ = '\t';
+            else if (*from == '\\' || (*from == delimiter && delimiter)) *to++ = *from;
+            else return false;
+            from++;
+            continue;
+        }
+        *to++ = *from++;
+    }
+
+    *length = to - s;
+    if (*from != delimiter) return false;
+    *end = delimiter ? from + 1 : from;
+    return true;
+}
+
+// A script can run over the file in one pass, without loading it, as long as the cursor only
+// ever moves forward, it never needs the line count (N%) and it saves once, at the end
+bool editorBatchStreamable(editorBatchScript *script) {
+    if (script->count == 0 || script->commands[script->count - 1].type != BATCH_SAVE) return false;
+
+    long long cursor = 0;
+    for (int i = 0; i < script->count; i++) {
+        editorBatchCommand *command = &script->commands[i];
+        switch (command->type)
+        {
+            case BATCH_GOTO:
+                if (command->percent || command->line - 1 < cursor) return false;
+                cursor = command->line == LLONG_MAX ? LLONG_MAX : command->line - 1;
+                break;
+            case BATCH_INSERT:
+                if (cursor != LLONG_MAX) cursor++;
+                break;
+            case BATCH_SAVE:
+                if (i != script->count - 1) return false;
+                break;
+        }
+    }
+    return true;
+}
+
+// Runs in its own process. Returns -1 (having said why) if the file didn't make it
+int editorBatchFile(editorBatchScript *script, char *fileName) {
+    int fd = open(fileName, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        fprintf(stderr, "%s: %s\n", fileName, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    if (script->streamable && S_ISREG(st.st_mode))
+    {
+        editorBatchStream stream = {0};
+        stream.script = script;
+        stream.data = "";
+        if (st.st_size > 0)
+        {
+            char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                fprintf(stderr, "%s: %s\n", fileName, strerror(errno));
+                close(fd);
+                return -1;
+            }
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            stream.data = data;
+            stream.length = st.st_size;
+        }
+        close(fd);
+
+        int result = editorReplaceFile(fileName, editorBatchStreamRows, &stream);
+        if (result == -1) fprintf(stderr, "%s: %s\n", fileName, strerror(errno));
+        if (stream.length) munmap((char *) stream.data, stream.length);
+        return result;
+    }
+    close(fd);
+
+    return editorBatchEdit(script, fileName);
+}
+
+// The general case, the whole file goes into rows and the script runs on them
+int editorBatchEdit(editorBatchScript *script, char *fileName) {
+    initializeEditorSized(24, 80);    // nothing gets drawn, any size will do
+    editor.undoSkipGroup = editor.undoGroup;
+    editorOpen(fileName);
+    editor.syntax = NULL;
+
+    for (int i = 0; i < script->count; i++) {
+        editorBatchCommand *command = &script->commands[i];
+        int rows;
+        switch (command->type)
+        {
+            case BATCH_GOTO:
+                {
+                    long long line = command->line;
+                    if (command->percent) line = ((line > 100 ? 100 : line) * editor.numRows + 99) / 100;
+                    if (line > editor.numRows + 1LL) line = editor.numRows + 1LL;
+                    editor.cy = line > 0 ? line - 1 : 0;
+                }
+                break;
+            case BATCH_INSERT:
+                editorInsertRow(editor.cy, command->text, command->textLength);
+                editor.cy++;
+                break;
+            case BATCH_DELETE:
+                editorDelRows(editor.cy, command->count);
+                break;
+            case BATCH_REPLACE:
+                editorReplaceText(command->text, command->replacement, &rows);
+                break;
+            case BATCH_SAVE:
+                editorStartSave();
+                editorFinishSave();
+                if (editor.save.error)
+                {
+                    fprintf(stderr, "%s: %s\n", fileName, strerror(editor.save.error));
+                    return -1;
+                }
+                break;
+        }
+    }
+    return 0;
+}
+
+// Writes the edited file straight from the old one, a line at a time
+int editorBatchStreamRows(int fd, void *arg) {
+    editorBatchStream *stream = arg;
+    editorBatchScript *script = stream->script;
+    const char *p = stream->data;
+    const char *end = stream->data + stream->length;
+    long long cursor = 0;
+    int length;
+
+    stream->fd = fd;
+    stream->failed = false;
+    for (int i = 0; i < script->count; i++) {
+        editorBatchCommand *command = &script->commands[i];
+        switch (command->type)
+        {
+            case BATCH_GOTO:
+                while (cursor < command->line - 1 && p < end)
+                {
+                    const char *line = p;
+                    p = editorBatchNextLine(p, end, &length);
+                    editorBatchEmit(stream, line, length, 0);
+                    cursor++;
+                }
+                break;
+            case BATCH_INSERT:
+                // Replaces before the insert didn't see this row
+                editorBatchEmit(stream, command->text, command->textLength, i + 1);
+                cursor++;
+                break;
+            case BATCH_DELETE:
+                for (int j = 0; j < command->count && p < end; j++) p = editorBatchNextLine(p, end, &length);
+                break;
+            case BATCH_SAVE:
+                while (p < end)
+                {
+                    const char *line = p;
+                    p = editorBatchNextLine(p, end, &length);
+                    editorBatchEmit(stream, line, length, 0);
+                }
+                break;
+        }
+    }
+
+    if (!stream->failed && stream->out.len && writeAll(fd, stream->out.b, stream->out.len) == -1) stream->failed = true;
+    abFree(&stream->out);
+    abFree(&stream->scratch[0]);
+    abFree(&stream->scratch[1]);
+    return stream->failed ? -1 : 0;
+}
+
+// Same split as editorLoadBuffer(). Returns where the next line starts
+const char* editorBatchNextLine(const char *p, const char *end, int *length) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *next = newline ? newline + 1 : end;
+    int lineLength = (newline ? newline : end) - p;
+
+    while (lineLength > 0 && p[lineLength - 1] == '\r') lineLength--;
+    *length = lineLength;
+    return next;
+}
+
+// Appends a row to the output, after the script's replaces from command `first` on
+void editorBatchEmit(editorBatchStream *stream, const char *s, int length, int first) {
+    editorBatchScript *script = stream->script;
+
+    for (int i = first; i < script->count; i++) {
+        editorBatchCommand *command = &script->commands[i];
+        if (command->type != BATCH_REPLACE) continue;
+
+        const char *match = editorMemSearch(s, length, command->text, command->textLength);
+        if (match == NULL) continue;
+
+        struct appendBuffer *next = s == stream->scratch[0].b ? &stream->scratch[1] : &stream->scratch[0];
+        const char *from = s;
+        next->len = 0;
+        while (match)
+        {
+            abAppend(next, from, match - from);
+            abAppend(next, command->replacement, command->replacementLength);
+            from = match + command->textLength;
+            match = editorMemSearch(from, s + length - from, command->text, command->textLength);
+        }
+        abAppend(next, from, s + length - from);
+        s = next->b;
+        length = next->len;
+    }
+
+    abAppend(&stream->out, s, length);
+    abAppend(&stream->out, "\n", 1);
+    if (stream->out.len >= ZTEXT_READ_BLOCK)
+    {
+        if (!stream->failed && writeAll(stream->fd, stream->out.b, stream->out.len) == -1) stream->failed = true;
+        stream->out.len = 0;
+    }
+}
+
+// Viewer
+
+// ztext -R FILE pages through files too big to load, logs of a hundred GB and more. Only
+// about ZTEXT_VIEW_ROWS lines around the cursor are ever in rows, read out of a window of the
+// file mapped around them, and moving near either end of them loads the next stretch instead.
+// A thread indexes the file in the background, keeping where every ZTEXT_VIEW_CHECKPOINT-th
+// line starts, which is what line numbers and goto work from. Memory stays at about the
+// window plus 8 bytes per checkpoint, however big the file
+//
+//     space b j k    page down, page up, line down, line up (the arrows work too)
+//     g G            start, end of the file
+//     / ?            search forward, backward
+//     n N            next match, in the same direction or the other one
+//     Ctrl-G         go to line N or N%
+//     q              quit
+
+void editorViewOpen(char *fileName) {
+    editorViewer *view = &editor.view;
+
+    view->fd = open(fileName, O_RDONLY);
+    if (view->fd == -1) printEditorError("Cannot open file");
+
+    struct stat st;
+    if (fstat(view->fd, &st) == -1) printEditorError("Cannot stat file");
+    if (!S_ISREG(st.st_mode)) printEditorError("-R only works on regular files");
+
+    free(editor.fileName);
+    editor.fileName = strdup(fileName);
+    editorSelectSyntaxHighlight();
+
+    view->active = true;
+    view->size = st.st_size;
+    view->map = NULL;
+    view->firstLine = 0;
+    view->checkpoints = malloc(sizeof(long long));
+    if (view->checkpoints == NULL) printEditorError("Cannot allocate index");
+    view->checkpoints[0] = 0;
+    view->numCheckpoints = 1;
+    view->checkpointsCapacity = 1;
+    view->pageSize = sysconf(_SC_PAGESIZE);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = handleViewBus;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &sa, NULL);
+
+    setStatusMessage("HELP: q quit | space/b page | g/G start/end | / ? search | n/N next | Ctrl-G go to");
+    if (pthread_create(&view->thread, NULL, editorViewIndexThread, view) != 0)
+        setStatusMessage("No thread to index the file, line numbers are off");
+
+    editorViewShow(0, 0, 0, 0);
+}
+
+// Maps the file around from..to, unless the window already covers it. Returns where `from` is.
+// Callers keep to - from within ZTEXT_VIEW_MAP
+const char* editorViewMap(long long from, long long to) {
+    editorViewer *view = &editor.view;
+    if (view->map && from >= view->mapStart && to <= view->mapStart + view->mapLength)
+        return view->map + (from - view->mapStart);
+
+    editorViewUnmap();
+
+    long long slack = to - from < ZTEXT_VIEW_MAP ? (ZTEXT_VIEW_MAP - (to - from)) / 2 : 0;
+    long long start = from > slack ? from - slack : 0;
+    start -= start % view->pageSize;
+    long long end = to + slack < view->size ? to + slack : view->size;
+
+    view->map = mmap(NULL, end - start, PROT_READ, MAP_PRIVATE, view->fd, start);
+    view->mapped = view->map != MAP_FAILED;
+    if (!view->mapped)
+    {
+        // Out of address space, or a file that won't be mapped. Reading just what's asked for will do
+        start = from;
+        end = to;
+        view->map = malloc(end - start + 1);
+        if (view->map == NULL) printEditorError("Cannot allocate file window");
+        long long got = preadAll(view->fd, view->map, end - start, start);
+        if (got < end - start)
+        {
+            memset(view->map + got, 0, end - start - got);
+            view->truncated = 1;
+        }
+    }
+    view->mapStart = start;
+    view->mapLength = end - start;
+    return view->map + (from - start);
+}
+
+void editorViewUnmap() {
+    editorViewer *view = &editor.view;
+    if (view->map == NULL) return;
+    if (view->mapped) munmap(view->map, view->mapLength);
+    else free(view->map);
+    view->map = NULL;
+}
+
+// A mapped page past the end of a file that was cut short under us. It gets swapped for zeros,
+// along with the rest of the window after it, so the read goes on and editorViewCheckSize()
+// sorts things out after the key
+void handleViewBus(int signal, siginfo_t *info, void *context) {
+    (void) context;
+    editorViewer *view = &editor.view;
+    char *address = info->si_addr;
+    if (!view->mapped || view->map == NULL || address < view->map || address >= view->map + view->mapLength)
+    {
+        // Not ours, so it goes back to killing us when the access is retried
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_DFL;
+        sigaction(signal, &sa, NULL);
+        return;
+    }
+
+    char *page = view->map + (address - view->map) / view->pageSize * view->pageSize;
+    mmap(page, view->map + view->mapLength - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    view->truncated = 1;
+}
+
+// After every key. A file that got shorter (a log truncated in place, say) leaves the window,
+// the rows and the index pointing past its end, so all of them are pulled back inside it
+void editorViewCheckSize() {
+    editorViewer *view = &editor.view;
+    struct stat st;
+    bool shrunk = fstat(view->fd, &st) == 0 && st.st_size < view->size;
+    if (!shrunk && !view->truncated) return;
+
+    // Zeros may stand in for what used to be there, the window gets mapped again either way
+    editorViewUnmap();
+    view->truncated = 0;
+    if (shrunk)
+    {
+        view->size = st.st_size;
+        while (view->numCheckpoints > 1 && view->checkpoints[view->numCheckpoints - 1] > view->size) view->numCheckpoints--;
+        if (view->indexed > view->size) view->indexed = view->size;
+        if (view->indexDone && view->error == 0) view->error = ESTALE;    // the line count is off now
+    }
+
+    bool inside = view->start < view->size;
+    long long offset = inside ? view->start : view->size ? editorViewLineStart(view->size - 1) : 0;
+    editorViewShow(offset, inside ? view->firstLine : -1, inside ? 0 : editor.terminalRows - 1, 0);
+    setStatusMessage("File shrank to %lld bytes", view->size);
+}
+
+// Moves n lines on from the line starting at offset, back for a negative n. Stops at either
+// end of the file, or where the next line would start more than budget bytes away. *moved
+// gets how many lines it made
+long long editorViewSkip(long long offset, long long n, long long budget, long long *moved) {
+    editorViewer *view = &editor.view;
+    *moved = 0;
+
+    if (n > 0)
+    {
+        long long limit = offset + budget < view->size ? offset + budget : view->size;
+        if (limit <= offset) return offset;
+        const char *data = editorViewMap(offset, limit);
+        long long length = limit - offset;
+        long long at = 0;
+
+        while (*moved < n && at < length)
+        {
+            const char *newline = memchr(data + at, '\n', length - at);
+            if (newline) at = newline + 1 - data;
+            else if (limit == view->size) at = length;     // the last line, without a newline
+            else break;
+            (*moved)++;
+        }
+        return offset + at;
+    }
+
+    long long lo = offset > budget ? offset - budget : 0;
+    if (offset <= lo) return offset;
+    const char *data = editorViewMap(lo, offset);
+    long long at = offset - lo;
+
+    while (*moved < -n && at > 0)
+    {
+        // The newline at at - 1 ends the line before, that one starts after the newline before it
+        const char *newline = at > 1 ? memrchr(data, '\n', at - 1) : NULL;
+        if (newline) at = newline + 1 - data;
+        else if (lo == 0) at = 0;
+        else break;
+        (*moved)++;
+    }
+    return lo + at;
+}
+
+// Start of the line holding the byte at offset
+long long editorViewLineStart(long long offset) {
+    long long lo = offset > ZTEXT_VIEW_BYTES ? offset - ZTEXT_VIEW_BYTES : 0;
+    if (offset <= lo) return offset;
+
+    const char *data = editorViewMap(lo, offset);
+    const char *newline = memrchr(data, '\n', offset - lo);
+    return newline ? lo + (newline + 1 - data) : lo;
+}
+
+// Line number of the line starting at offset, -1 while the index hasn't got that far
+long long editorViewLineAt(long long offset) {
+    editorViewer *view = &editor.view;
+    if (offset > view->indexed) return -1;
+
+    long long lo = 0, hi = view->numCheckpoints - 1;
+    while (lo < hi)
+    {
+        long long mid = (lo + hi + 1) / 2;
+        if (view->checkpoints[mid] <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+
+    // The lines between the checkpoint and offset can be any length, so they're counted a window at a time
+    long long count = 0;
+    for (long long at = view->checkpoints[lo]; at < offset; ) {
+        long long to = offset - at > ZTEXT_VIEW_BYTES ? at + ZTEXT_VIEW_BYTES : offset;
+        count += editorCountNewlines(editorViewMap(at, to), to - at);
+        at = to;
+    }
+    return lo * ZTEXT_VIEW_CHECKPOINT + count;
+}
+
+// Where line `line` starts, -1 while the index hasn't got that far
+long long editorViewLineOffset(long long line) {
+    editorViewer *view = &editor.view;
+    long long checkpoint = line / ZTEXT_VIEW_CHECKPOINT;
+    if (checkpoint >= view->numCheckpoints) return -1;
+
+    long long moved;
+    return editorViewSkip(view->checkpoints[checkpoint], line % ZTEXT_VIEW_CHECKPOINT, ZTEXT_VIEW_MAP, &moved);
+}
+
+// Loads the lines around the one starting at offset (line number `line`, -1 if unknown) into
+// the rows, and puts the cursor on it at column cx, screenRow lines down the screen
+void editorViewShow(long long offset, long long line, int screenRow, int cx) {
+    editorViewer *view = &editor.view;
+
+    long long before, count;
+    long long start = editorViewSkip(offset, -ZTEXT_VIEW_ROWS / 2, ZTEXT_VIEW_BYTES / 2, &before);
+    long long end = editorViewSkip(start, ZTEXT_VIEW_ROWS, ZTEXT_VIEW_BYTES, &count);
+    if (end <= offset)
+    {
+        // A line longer than the whole window, what fits of it will have to do
+        end = start + ZTEXT_VIEW_BYTES < view->size ? start + ZTEXT_VIEW_BYTES : view->size;
+        before = 0;
+        start = offset;
+    }
+
+    editorCloseFile();
+    if (end > start) editorLoadBuffer(editorViewMap(start, end), end - start);
+    view->start = start;
+    view->end = end;
+    view->firstLine = line >= 0 ? line - before : editorViewLineAt(start);
+
+    editor.cy = before < editor.numRows ? before : editor.numRows;
+    editorRow *row = editorRowAt(editor.cy);
+    editor.cx = row == NULL ? 0 : cx < row->size ? cx : row->size;
+    editor.rowOffset = editor.cy > screenRow ? editor.cy - screenRow : 0;
+}
+
+// After every key. A cursor getting near the first or last of the rows brings in the lines past them
+void editorViewFollow() {
+    editorViewer *view = &editor.view;
+    int margin = ZTEXT_VIEW_ROWS / 4;
+    if ((editor.cy >= margin || view->start == 0) && (editor.cy <= editor.numRows - margin || view->end == view->size)) return;
+
+    long long moved;
+    long long offset = editorViewSkip(view->start, editor.cy, ZTEXT_VIEW_BYTES, &moved);
+    editorViewShow(offset, view->firstLine >= 0 ? view->firstLine + moved : -1, editor.cy - editor.rowOffset, editor.cx);
+}
+
+// Keys mean what they do in less. Moving around goes on to processKey() as the key returned,
+// everything else is taken care of here and comes back as 0
+int editorViewKey(int c) {
+    editorViewer *view = &editor.view;
+
+    switch (c)
+    {
+        case ' ':
+            return PAGE_DOWN;
+        case 'b':
+            return PAGE_UP;
+        case 'j':
+            return ARROW_DOWN;
+        case 'k':
+            return ARROW_UP;
+        case 'q':
+            return CTRL_KEY('q');
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case HOME_KEY:
+        case END_KEY:
+        case CTRL_KEY('q'):
+        case CTRL_KEY('l'):
+        case CTRL_KEY('t'):
+        case PASTE_END:
+        case '\x1b':
+            return c;
+        case 'g':
+        case '<':
+            editorViewShow(0, 0, 0, 0);
+            break;
+        case 'G':
+        case '>':
+            if (view->size) editorViewShow(editorViewLineStart(view->size - 1),
+                view->indexDone && view->error == 0 ? view->lines - 1 : -1, editor.terminalRows - 1, 0);
+            break;
+        case CTRL_KEY('g'):
+            editorViewGotoLine();
+            break;
+        case '/':
+        case '?':
+        case CTRL_KEY('f'):
+            {
+                char *query = editorPrompt(c == '?' ? "Search backward: %s (ESC to cancel)" : "Search: %s (ESC to cancel)", NULL);
+                if (query == NULL) break;
+                free(view->query);
+                view->query = query;
+                view->direction = c == '?' ? -1 : 1;
+                editorViewFind(view->direction);
+            }
+            break;
+        case 'n':
+        case 'N':
+            if (view->query == NULL) setStatusMessage("Nothing searched for yet");
+            else editorViewFind(c == 'n' ? view->direction : -view->direction);
+            break;
+        default:
+            setStatusMessage("Read only, q quits");
+            break;
+    }
+    return 0;
+}
+
+void editorViewGotoLine() {
+    editorViewer *view = &editor.view;
+    long long value;
+    bool percent;
+    if (!editorPromptLine(&value, &percent)) return;
+
+    bool counted = view->indexDone && view->error == 0;
+    if (percent && !counted)
+    {
+        // No line count yet, so it's that far into the bytes instead
+        if (view->size) editorViewShow(editorViewLineStart(view->size * value / 100 - (value == 100)), -1, editor.terminalRows / 2, 0);
+        return;
+    }
+    if (percent) value = (value * view->lines + 99) / 100;
+    if (counted && value > view->lines) value = view->lines;
+    long long line = value > 0 ? value - 1 : 0;
+
+    long long offset = editorViewLineOffset(line);
+    if (offset == -1)
+    {
+        setStatusMessage("Line %lld isn't indexed yet, only the first %lld are", value,
+            (view->numCheckpoints - 1) * ZTEXT_VIEW_CHECKPOINT);
+        return;
+    }
+    editorViewShow(offset, line, editor.terminalRows / 2, 0);
+}
+
+// Looks for the last query from the cursor on, a block of the file at a time. Searching a
+// big file takes a while, so the status bar keeps count and any key calls it off
+void editorViewFind(int direction) {
+    editorViewer *view = &editor.view;
+    const char *query = view->query;
+    long long queryLength = strlen(query);
+    if (queryLength == 0) return;
+
+    long long moved;
+    long long rowStart = editorViewSkip(view->start, editor.cy, ZTEXT_VIEW_BYTES, &moved);
+    long long from = rowStart + editor.cx;
+    long long found = -1;
+    long long searched = 0;
+    long long lastShown = monotonicMs();
+    bool cancelled = false;
+
+    if (direction > 0)
+    {
+        // Blocks overlap by a query less a byte, so no match falls between two of them
+        for (long long at = from + 1; at < view->size && found == -1; at += ZTEXT_VIEW_BYTES - queryLength + 1) {
+            long long to = at + ZTEXT_VIEW_BYTES < view->size ? at + ZTEXT_VIEW_BYTES : view->size;
+            const char *data = editorViewMap(at, to);
+            const char *match = editorMemSearch(data, to - at, query, queryLength);
+            if (match) found = at + (match - data);
+            searched = to - from;
+            if (to == view->size || (cancelled = editorViewFindCancelled(searched, &lastShown))) break;
+        }
+    }else
+    {
+        for (long long to = from + queryLength - 1 < view->size ? from + queryLength - 1 : view->size; to > 0 && found == -1; ) {
+            long long at = to > ZTEXT_VIEW_BYTES ? to - ZTEXT_VIEW_BYTES : 0;
+            const char *data = editorViewMap(at, to);
+            for (const char *match = data; (match = editorMemSearch(match, to - at - (match - data), query, queryLength)); match++)
+            {
+                if (at + (match - data) >= from) break;
+                found = at + (match - data);
+            }
+            searched = from - at;
+            if (at == 0 || (cancelled = editorViewFindCancelled(searched, &lastShown))) break;
+            to = at + queryLength - 1;
+        }
+    }
+
+    if (found == -1)
+    {
+        if (!cancelled) setStatusMessage("Not found: %s", query);
+        return;
+    }
+
+    long long lineStart = editorViewLineStart(found);
+    editorViewShow(lineStart, -1, editor.terminalRows / 2, found - lineStart);
+    setStatusMessage("");
+}
+
+// Between blocks of a search: shows how far it got now and then, and says whether a key
+// came in to stop it
+bool editorViewFindCancelled(long long searched, long long *lastShown) {
+    long long now = monotonicMs();
+    if (now - *lastShown < ZTEXT_PROGRESS_MS) return false;
+    *lastShown = now;
+
+    if (inputPending())
+    {
+        readKey();
+        setStatusMessage("Search stopped after %lld MB", searched >> 20);
+        return true;
+    }
+    setStatusMessage("Searching... %lld MB (any key stops)", searched >> 20);
+    refreshScreen();
+    return false;
+}
+
+// Reads through the file counting lines, on a thread of its own. Checkpoints go to the main
+// loop in batches, see editorViewMergeIndex()
+void *editorViewIndexThread(void *arg) {
+    editorViewer *view = arg;
+    char *buf = malloc(ZTEXT_READ_BLOCK);
+    long long offset = 0;
+    long long newlines = 0;
+    long long next = ZTEXT_VIEW_CHECKPOINT;
+    long long lastNotify = monotonicMs();
+    long long size = view->size;    // the main thread's to change, if the file shrinks
+    int error = buf ? 0 : ENOMEM;
+    char last = '\n';
+
+    posix_fadvise(view->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (offset < size && error == 0)
+    {
+        ssize_t nRead = pread(view->fd, buf, ZTEXT_READ_BLOCK, offset);
+        if (nRead == -1 && errno == EINTR) continue;
+        if (nRead == 0) break;    // cut short while we read, the index ends where the file does
+        if (nRead == -1)
+        {
+            error = errno;
+            break;
+        }
+
+        // Only blocks with a checkpoint in them need to know where their newlines are
+        long long count = editorCountNewlines(buf, nRead);
+        if (newlines + count < next)
+        {
+            newlines += count;
+        }else
+        {
+            for (char *p = buf; (p = memchr(p, '\n', buf + nRead - p)); p++)
+            {
+                if (++newlines < next) continue;
+                pthread_mutex_lock(&view->lock);
+                editorViewPublish(view, offset + (p + 1 - buf));
+                pthread_mutex_unlock(&view->lock);
+                next += ZTEXT_VIEW_CHECKPOINT;
+            }
+        }
+        offset += nRead;
+        last = buf[nRead - 1];
+
+        pthread_mutex_lock(&view->lock);
+        view->pendingIndexed = offset;
+        pthread_mutex_unlock(&view->lock);
+
+        if (monotonicMs() - lastNotify >= ZTEXT_LOAD_NOTIFY_MS)
+        {
+            notifyMainLoop();
+            lastNotify = monotonicMs();
+        }
+    }
+    free(buf);
+
+    pthread_mutex_lock(&view->lock);
+    view->pendingLines = newlines + (last != '\n');
+    view->pendingError = error;
+    view->pendingDone = true;
+    pthread_mutex_unlock(&view->lock);
+
+    notifyMainLoop();
+    return NULL;
+}
+
+// Queues a checkpoint for the main thread. Called with the lock held
+void editorViewPublish(editorViewer *view, long long offset) {
+    if (view->numPending == view->pendingCapacity)
+    {
+        view->pendingCapacity = view->pendingCapacity ? view->pendingCapacity * 2 : 1024;
+        view->pending = realloc(view->pending, sizeof(long long) * view->pendingCapacity);
+        if (view->pending == NULL) printEditorError("Cannot allocate index");
+    }
+    view->pending[view->numPending++] = offset;
+}
+
+// Takes in what the index thread found since last time
+void editorViewMergeIndex() {
+    editorViewer *view = &editor.view;
+    if (!view->active || view->indexDone) return;
+
+    pthread_mutex_lock(&view->lock);
+    long long needed = view->numCheckpoints + view->numPending;
+    if (needed > view->checkpointsCapacity)
+    {
+        while (view->checkpointsCapacity < needed) view->checkpointsCapacity *= 2;
+        view->checkpoints = realloc(view->checkpoints, sizeof(long long) * view->checkpointsCapacity);
+        if (view->checkpoints == NULL) printEditorError("Cannot allocate index");
+    }
+    if (view->numPending) memcpy(view->checkpoints + view->numCheckpoints, view->pending, sizeof(long long) * view->numPending);
+    view->numCheckpoints = needed;
+    view->numPending = 0;
+    view->indexed = view->pendingIndexed;
+    view->lines = view->pendingLines;
+    view->error = view->pendingError;
+    view->indexDone = view->pendingDone;
+    pthread_mutex_unlock(&view->lock);
+
+    // Whatever the thread read before the file shrank is gone again
+    if (view->indexed > view->size)
+    {
+        while (view->numCheckpoints > 1 && view->checkpoints[view->numCheckpoints - 1] > view->size) view->numCheckpoints--;
+        view->indexed = view->size;
+        if (view->error == 0) view->error = ESTALE;
+    }
+
+    if (view->indexDone)
+    {
+        pthread_join(view->thread, NULL);
+        if (view->error && view->error != ESTALE) setStatusMessage("Indexing stopped: %s", strerror(view->error));
+    }
+    if (view->firstLine < 0) view->firstLine = editorViewLineAt(view->start);
+}
+
+// Input functions
+
+char* editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    // Timers don't run while a prompt waits for keys, so the journal can't be left waiting on one
+    editorJournalFlush();
+
+    size_t bufSize = 128;
+    char *buf = malloc(bufSize);
+
+    size_t bufLength = 0;
+    buf[0] = '\0';
+
+    while (true)
+    {
+        setStatusMessage(prompt, buf);
+        refreshScreen();
+
+        int c = readKey();
+
+        if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+        {
+            // The whole character goes, not just its last byte
+            while (bufLength != 0 && (buf[--bufLength] & 0xC0) == 0x80);
+            buf[bufLength] = '\0';
+        }else if (c == '\x1b')
+        {
+            setStatusMessage("");
+            if (callback) callback(buf, c);
+            free(buf);
+            return NULL;
+        }else if (c == '\r')
+        {
+            if (bufLength != 0)
+            {
+                setStatusMessage("");
+                if (callback) callback(buf, c);
+                return buf;
+            }
+        }else if (c < 256 && !iscntrl(c))
+        {
+            if (bufLength == bufSize - 1)
+            {
+                bufSize *= 2;
+                buf = realloc(buf, bufSize);
+            }
+            buf[bufLength++] = c;
+            buf[bufLength] = '\0';
+        }
+
+        if (callback) callback(buf, c);
+    }
+}
+
+void moveCursor(int c){
+
+    editorRow *row = editorRowAt(editor.cy);
+
+    switch(c){
+        case ARROW_UP:
+            if(editor.cy != 0)
+            {
+                // Stay on the same screen column, whatever the tabs above look like
+                int rx = row ? editorRowCxToRx(row, editor.cx) : 0;
+                editor.cy--;
+                editor.cx = editorRowRxToCx(editorRowAt(editor.cy), rx);
+            }
+            break;
+        case ARROW_LEFT:
+            if(editor.cx != 0)
+            {
+                editor.cx = editorRowPrevChar(row, editor.cx);
+            }else if(editor.cy > 0)
+            {
+                editor.cy--;
+                editor.cx = editorRowAt(editor.cy)->size;
+            }
+            break;
+        case ARROW_DOWN:
+            if(editor.cy < editor.numRows)
+            {
+                int rx = editorRowCxToRx(row, editor.cx);
+                editor.cy++;
+                row = editorRowAt(editor.cy);
+                editor.cx = row ? editorRowRxToCx(row, rx) : 0;
+            }
+            break;
+        case ARROW_RIGHT:
+            if(row && editor.cx < row->size)
+            {
+                editor.cx = editorRowNextChar(row, editor.cx);
+            }else if (row && editor.cx == row->size)
+            {
+                editor.cy++;
+                editor.cx = 0;
+            }
+            break;
+    }
 
-    int index = 0;
-    for (i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t')
+    row = editorRowAt(editor.cy);
+    int rowLength = row ? row->size : 0;
+    if (editor.cx > rowLength) {
+        editor.cx = rowLength;
+    }
+}
+
+// Ctrl-G: a line number, or "50%" for that far into the file
+void editorGotoLine() {
+    long long value;
+    bool percent;
+    if (!editorPromptLine(&value, &percent)) return;
+
+    if (percent) value = (value * editor.numRows + 99) / 100;
+    if (value > editor.numRows) value = editor.numRows;
+    editorJumpToRow(value > 0 ? value - 1 : 0);
+}
+
+// Asks for a line number, or a percentage (capped at 100) when *percent comes back set
+bool editorPromptLine(long long *value, bool *percent) {
+    char *input = editorPrompt("Go to line: %s (N or N%%, ESC to cancel)", NULL);
+    if (input == NULL) return false;
+
+    char *end;
+    errno = 0;
+    *value = strtoll(input, &end, 10);
+    *percent = *end == '%';
+    if (*percent) end++;
+    if (end == input || *end != '\0' || *value < 0 || errno)
+    {
+        setStatusMessage("Not a line number: %s", input);
+        free(input);
+        return false;
+    }
+    free(input);
+
+    if (*percent && *value > 100) *value = 100;
+    return true;
+}
+
+// Rows are found through the chunk index, so this costs the same anywhere in the file.
+// The row lands in the middle of the screen
+void editorJumpToRow(int at) {
+    editor.cy = at;
+    editor.cx = 0;
+    editor.rowOffset = at - editor.terminalRows / 2;
+    if (editor.rowOffset < 0) editor.rowOffset = 0;
+}
+
+// Handles the next key, then everything else already waiting, so a burst of input costs one redraw
+void processInputs(){
+    do {
+        // A key that turns tracing on has no start time, it isn't part of the trace
+        bool traced = editor.trace.enabled;
+        long long start = editorTraceClock();
+        int c = readKey();
+        long long decoded = editorTraceClock();
+        processKey(c);
+        // One sync for everything the key did, however many rows a paste or an undo touched
+        if (editor.journal.pendingOps >= ZTEXT_JOURNAL_OPS) editorJournalFlush();
+        if (traced && editor.trace.enabled) editorTraceKey(start, decoded, editorTraceClock());
+    } while (inputPending());
+}
+
+void processKey(int c){
+    static int quit_times = ZTEXT_QUIT_TIMES;
+
+    // Every key is its own undo step, typing runs merge across them on their own
+    editor.undoGroup++;
+
+    if (editor.view.active && (c = editorViewKey(c)) == 0)
+    {
+        editorViewCheckSize();
+        return;
+    }
+
+    switch (c)
+    {
+        case '\r':
+            editorInsertNewLine();
+            break;
+        case CTRL_KEY('q'):
+            if (editor.stinky && quit_times > 0) {
+                setStatusMessage("WARNING! File has unsaved changes."
+                    "Press Ctrl-Q %d more time(s) to quit", quit_times);
+                quit_times--;
+                return;
+            }
+            // Let a running save land before we go. Quitting is the one way to throw edits away
+            editorFinishSave();
+            editorJournalDiscard();
+            write(STDOUT_FILENO, "\x1b[2J", 4);
+            write(STDOUT_FILENO, "\x1b[H", 3);
+            exit(0);
+        case CTRL_KEY('s'):
+            editorSaveFile();
+            break;
+        case CTRL_KEY('f'):
+            editorFind();
+            break;
+        case CTRL_KEY('g'):
+            editorGotoLine();
+            break;
+        case CTRL_KEY('t'):
+            editorTraceToggleHud();
+            break;
+        case CTRL_KEY('a'):
+            editorFindAll();
+            break;
+        case CTRL_KEY('r'):
+            editorReplaceAll();
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+        case HOME_KEY:
+            editor.cx = 0;
+            break;
+        case END_KEY:
+            if (editor.cy < editor.numRows)
+                editor.cx = editorRowAt(editor.cy)->size;
+            break;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DELETE_KEY:
+            if (c == DELETE_KEY) moveCursor(ARROW_RIGHT);
+            editorDelChar();
+            break;
+        case PAGE_UP:
+        case PAGE_DOWN:
+            {
+                // A screen's worth of rows in one go, on the same screen column
+                editorRow *row = editorRowAt(editor.cy);
+                int rx = row ? editorRowCxToRx(row, editor.cx) : 0;
+                if(c == PAGE_UP)
+                {
+                    editor.cy = editor.rowOffset - editor.terminalRows;
+                    if (editor.cy < 0) editor.cy = 0;
+                    editor.rowOffset = editor.cy;
+                }else
+                {
+                    editor.cy = editor.rowOffset + 2 * editor.terminalRows - 1;
+                    if (editor.cy > editor.numRows) editor.cy = editor.numRows;
+                    if (editor.cy >= editor.rowOffset + editor.terminalRows)
+                        editor.rowOffset = editor.cy - editor.terminalRows + 1;
+                }
+
+                row = editorRowAt(editor.cy);
+                editor.cx = row ? editorRowRxToCx(row, rx) : 0;
+            }
+            break;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            moveCursor(c);
+            break;
+        case CTRL_KEY('l'):
+            editor.screenValid = false;
+            break;
+        case PASTE_START:
+            editorPaste();
+            break;
+        case PASTE_END:
+        case '\x1b':
+            break;
+        default:
+            editorInsertChar(c);
+            break;
+    }
+
+    quit_times = ZTEXT_QUIT_TIMES;
+    if (editor.view.active)
+    {
+        editorViewCheckSize();
+        editorViewFollow();
+    }
+}
+
+// Follow mode
+
+// ztext -f FILE keeps the buffer up with a file something else appends to, like tail -f.
+// inotify says when the file (or its directory) changed, events arriving within ZTEXT_FOLLOW_MS
+// of each other are taken as one burst, and a burst costs one read of just the new bytes, one
+// append of the rows in them and one redraw. A file that shrank or got replaced (rotated) is
+// loaded again from scratch
+
+void editorFollowStart() {
+    editorFollow *follow = &editor.follow;
+
+    follow->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow->inotifyFd == -1)
+    {
+        setStatusMessage("Cannot follow %s: %s", editor.fileName, strerror(errno));
+        return;
+    }
+
+    // New files showing up under the name mean the old one was rotated away
+    char *slash = strrchr(editor.fileName, '/');
+    char *dir = slash == NULL ? strdup(".") : slash == editor.fileName ? strdup("/") : strndup(editor.fileName, slash - editor.fileName);
+    follow->dirWatch = inotify_add_watch(follow->inotifyFd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+
+    follow->active = true;
+    follow->fd = -1;
+    follow->fileWatch = -1;
+    editorFollowAttach();
+    watchFd(follow->inotifyFd, editorFollowEvents);
+    editorFollowTail();
+    setStatusMessage("Following %s", editor.fileName);
+}
+
+// Picks up from where editorOpen() stopped reading the file
+void editorFollowAttach() {
+    editorFollow *follow = &editor.follow;
+
+    if (follow->fd != -1) close(follow->fd);
+    follow->fd = open(editor.fileName, O_RDONLY | O_CLOEXEC);
+    follow->offset = editor.fileSize;
+    char last = '\n';
+    if (follow->fd != -1 && follow->offset > 0) pread(follow->fd, &last, 1, follow->offset - 1);
+    follow->partial = last != '\n';
+    follow->heldCr = -1;
+
+    if (follow->fileWatch != -1) inotify_rm_watch(follow->inotifyFd, follow->fileWatch);
+    follow->fileWatch = inotify_add_watch(follow->inotifyFd, editor.fileName, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+
+    // Swapped for another file in between the two opens, that one gets loaded instead
+    struct stat st;
+    if (follow->fd != -1 && fstat(follow->fd, &st) == 0 && (st.st_ino != editor.fileInode || st.st_dev != editor.fileDevice))
+        editorFollowReload("%s was replaced, reloaded");
+}
+
+void editorFollowEvents() {
+    editorFollow *follow = &editor.follow;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *slash = strrchr(editor.fileName, '/');
+    const char *name = slash ? slash + 1 : editor.fileName;
+    bool relevant = false;
+    ssize_t nRead;
+
+    while ((nRead = read(follow->inotifyFd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + nRead; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len)
         {
-            row->render[index++] = ' ';
-            while (index % ZTEXT_TAB_STOP != 0) row->render[index++] = ' ';
-        }else {
-            row->render[index++] = row->chars[i];
+            struct inotify_event *event = (struct inotify_event *) p;
+            if (event->wd == follow->fileWatch || (event->len && strcmp(event->name, name) == 0)) relevant = true;
         }
     }
 
-    row->render[index] = '\0';
-    row->renderSize = index;
+    if (relevant && editor.timers[FOLLOW_TIMER].deadline == 0)
+        setTimer(FOLLOW_TIMER, monotonicMs() + ZTEXT_FOLLOW_MS, editorFollowCheck);
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > editor.numRows) return;
+// Works out what happened to the file since last time and brings the buffer up to date
+void editorFollowCheck() {
+    editorFollow *follow = &editor.follow;
 
-    editor.row = realloc(editor.row, sizeof(editorRow) * (editor.numRows + 1));
-    memmove(&editor.row[at + 1], &editor.row[at], sizeof(editorRow) * (editor.numRows - at));
+    // The background load comes first, anything appended goes after it. It checks again once it's done
+    if (!follow->active || follow->fd == -1 || editor.load.running) return;
+    if (follow->tailRow >= 0 && editor.cy == follow->tailRow) editor.cy = editor.numRows - 1;
+    follow->tailRow = -1;
 
-    editor.row[at].size = len;
-    editor.row[at].chars = malloc(len + 1);
-    memcpy(editor.row[at].chars, s, len);
-    editor.row[at].chars[len] = '\0';
+    struct stat opened, named;
+    if (fstat(follow->fd, &opened) == -1) return;
 
-    editor.row[at].renderSize = 0;
-    editor.row[at].render = NULL;
-    editorUpdateRow(&editor.row[at]);
+    // Until something takes the place of a file moved or deleted away, it's still the one to follow
+    bool replaced = stat(editor.fileName, &named) == 0 && (named.st_ino != opened.st_ino || named.st_dev != opened.st_dev);
+    if (!replaced && opened.st_size == follow->offset) return;
 
-    editor.numRows++;
-    if (!editor.stinky) {
-        editor.stinky = true;
+    // New bytes would land after rows typed at the end or inside an edited last row, and a
+    // reload would throw the edits away. Neither happens, following waits for a save instead
+    bool reload = replaced || opened.st_size < follow->offset;
+    if (follow->tailEdited || (reload && editor.stinky))
+    {
+        if (!follow->stalled) setStatusMessage("Stopped following, unsaved edits at the end. Ctrl-S resumes");
+        follow->stalled = true;
+        return;
+    }
+
+    if (replaced)
+    {
+        editorFollowReload("%s was replaced, reloaded");
+    }else if (opened.st_size < follow->offset)
+    {
+        editorFollowReload("%s was truncated, reloaded");
+    }else if (opened.st_size > follow->offset)
+    {
+        editorFollowRead(opened.st_size);
     }
 }
 
-void editorRowInsertChar(editorRow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    if (!editor.stinky) {
-        editor.stinky = true;
+// Appends the file's bytes from the last known offset up to size. A cursor sitting on the
+// last row stays on the last row, the way tail -f would scroll
+void editorFollowRead(long long size) {
+    editorFollow *follow = &editor.follow;
+    long long length = size - follow->offset;
+    char *data = malloc(length);
+    if (data == NULL) printEditorError("Cannot allocate file buffer");
+
+    long long got = 0;
+    while (got < length)
+    {
+        ssize_t nRead = pread(follow->fd, data + got, length - got, follow->offset + got);
+        if (nRead == -1 && errno == EINTR) continue;
+        if (nRead <= 0) break;
+        got += nRead;
+    }
+
+    // A \r at the very end waits for the \n that's probably right behind it, but only for one
+    // burst. If nothing came after it by then, it goes in as it is
+    if (got > 0 && data[got - 1] == '\r' && follow->offset + got - 1 != follow->heldCr)
+    {
+        follow->heldCr = follow->offset + got - 1;
+        got--;
+        setTimer(FOLLOW_TIMER, monotonicMs() + ZTEXT_FOLLOW_MS, editorFollowCheck);
+    }
+    if (got == 0)
+    {
+        free(data);
+        return;
+    }
+
+    bool atEnd = editor.cy >= editor.numRows - 1;
+    const char *p = data;
+    const char *end = data + got;
+
+    // The first bytes finish off the last row, if it never saw its newline
+    if (follow->partial && editor.numRows > 0)
+    {
+        const char *newline = memchr(p, '\n', end - p);
+        size_t lineLength = (newline ? newline : end) - p;
+        while (lineLength > 0 && p[lineLength - 1] == '\r') lineLength--;
+
+        if (lineLength)
+        {
+            editorRow *row = editorRowForEdit(editor.numRows - 1);
+            int at = row->size;
+            editorRowReserve(row, row->size + lineLength + 1);
+            memcpy(&row->chars[at], p, lineLength);
+            row->size += lineLength;
+            row->chars[row->size] = '\0';
+            editorRowChanged(row, at, 0, lineLength);
+            editorHighlightChanged(editor.numRows - 1);
+        }
+        p = newline ? newline + 1 : end;
+    }
+
+    editorLoadBuffer(p, end - p);
+    follow->partial = end[-1] != '\n';
+    follow->offset += got;
+    free(data);
+
+    // The journal's edits apply to the file as it is now
+    editorJournalIdentify();
+
+    if (atEnd && editor.numRows > 0)
+    {
+        editor.cy = editor.numRows - 1;
+        editor.cx = 0;
     }
 }
 
-void editorFreeRow(editorRow *row) {
-    free(row->render);
-    free(row->chars);
+// Puts the cursor on the last row, and again once a background load has brought in the real last row
+void editorFollowTail() {
+    if (editor.numRows == 0) return;
+    editor.cy = editor.numRows - 1;
+    editor.cx = 0;
+    editor.follow.tailRow = editor.load.running ? editor.cy : -1;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= editor.numRows) return;
-    editorFreeRow(&editor.row[at]);
-    memmove(&editor.row[at], &editor.row[at] + 1,
-        sizeof(editorRow) * (editor.numRows - at - 1));
-    editor.numRows--;
-    if (!editor.stinky) {
-        editor.stinky = true;
+// The file was replaced or cut short, so what's in the buffer no longer lines up with it
+void editorFollowReload(const char *message) {
+    bool atEnd = editor.cy >= editor.numRows - 1;
+    char *fileName = strdup(editor.fileName);
+    editorOpen(fileName);
+    free(fileName);
+    editor.follow.tailEdited = false;
+    editorJournalDiscard();
+    editorJournalIdentify();
+    editorFollowAttach();
+    if (atEnd) editorFollowTail();
+    setStatusMessage(message, editor.fileName);
+}
+
+// Edits to the last row, or rows added after it, mean the buffer's end isn't the file's any more
+void editorFollowEdited(int y) {
+    if (editor.follow.active && y >= editor.numRows - 1) editor.follow.tailEdited = true;
+}
+
+// A save replaced the file with the buffer, which is what gets followed from now on
+void editorFollowSaved(long long written) {
+    struct stat st;
+    if (!editor.follow.active || stat(editor.fileName, &st) == -1) return;
+
+    // The file's end is the buffer's again, unless edits came in while the save ran
+    if (editor.version == editor.save.version)
+    {
+        editor.follow.tailEdited = false;
+        editor.follow.stalled = false;
     }
+
+    editor.fileDevice = st.st_dev;
+    editor.fileInode = st.st_ino;
+    editor.fileSize = written;
+    editorFollowAttach();
 }
 
-void editorRowDelChar(editorRow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    if (!editor.stinky) {
+// Journal
+
+// Every edit since the last save goes to .FILE.ztj next to the file, as the primitive it was
+// (the same ones undo logs), so a crash or a dropped SSH session costs at most the last
+// second of typing. Entries are batched in memory and synced after the key that brought them to
+// ZTEXT_JOURNAL_OPS, or ZTEXT_JOURNAL_MS after the oldest, and the journal goes away once a save catches up
+char* editorJournalPath(const char *fileName) {
+    char *path = realpath(fileName, NULL);
+    if (path == NULL) path = strdup(fileName);
+
+    char *slash = strrchr(path, '/');
+    int dirLength = slash ? slash - path + 1 : 0;
+    char *base = slash ? slash + 1 : path;
+
+    char *journal = malloc(strlen(path) + 8);
+    sprintf(journal, "%.*s.%s.ztj", dirLength, path, base);
+    free(path);
+    return journal;
+}
+
+void editorJournalStart() {
+    editor.journal.enabled = true;
+    if (editor.fileName) editorJournalRecover();
+    if (!editor.journal.enabled) return;
+    editorJournalIdentify();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleHangup;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// A journal left behind by a session that never got to save gets replayed onto the file,
+// as long as the file is still the one it was written against
+void editorJournalRecover() {
+    editorJournal *journal = &editor.journal;
+    char *path = editorJournalPath(editor.fileName);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+    {
+        free(path);
+        return;
+    }
+
+    struct stat st;
+    long long size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    char *data = size >= (long long) sizeof(editorJournalHeader) ? malloc(size) : NULL;
+    editorJournalHeader header;
+    if (data == NULL || preadAll(fd, data, size, 0) != size ||
+        memcmp(data, "ZTJRNL1\n", 8) != 0)
+    {
+        // Died before the header made it, there's nothing in there
+        free(data);
+        close(fd);
+        free(path);
+        return;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    // Whoever writes a journal keeps it locked, a crash or a reboot lets go of the lock. The pid
+    // alone can't tell, after a reboot it's as likely as not somebody else's
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+    {
+        setStatusMessage("ztext %d is editing this file, no journal for this one", header.pid);
+        journal->enabled = false;
+        free(data);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    editorJournalHeader current;
+    editorJournalStat(&current);
+    if (current.size != header.size || current.mtimeSec != header.mtimeSec ||
+        current.mtimeNsec != header.mtimeNsec || current.device != header.device || current.inode != header.inode)
+    {
+        // Replaying onto a different file would make a mess of it, leave it for a human to look at
+        char *old = malloc(strlen(path) + 5);
+        sprintf(old, "%s.old", path);
+        rename(path, old);
+        setStatusMessage("File changed since the crash, journal kept as %s", old);
+        free(old);
+        free(data);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    editorFinishLoad();
+    journal->suspended = true;
+    long long offset = sizeof(header);
+    int replayed = 0;
+    int lastY = 0;
+    int lastX = 0;
+    editorJournalEntry entry;
+    while (size - offset >= (long long) sizeof(entry))
+    {
+        memcpy(&entry, data + offset, sizeof(entry));
+        const char *s = data + offset + sizeof(entry);
+        if (entry.length < 0 || entry.length > size - offset - (long long) sizeof(entry) ||
+            entry.check != editorJournalChecksum(&entry, s) || !editorJournalApply(&entry, s)) break;
+
+        offset += sizeof(entry) + entry.length;
+        replayed++;
+        lastY = entry.y;
+        lastX = entry.type == UNDO_INSERT_CHARS || entry.type == UNDO_DELETE_CHARS ? entry.x : 0;
+    }
+    journal->suspended = false;
+    free(data);
+
+    // Whatever didn't make it whole is dropped, new entries go after the last good one
+    if (offset < size && ftruncate(fd, offset) == -1) offset = size;
+    journal->fd = fd;
+    journal->path = path;
+    journal->length = offset;
+    journal->header = header;
+
+    if (replayed)
+    {
+        // The cursor goes back to roughly where the last edit was
         editor.stinky = true;
+        editor.cy = lastY < editor.numRows ? lastY : editor.numRows - 1;
+        if (editor.cy < 0) editor.cy = 0;
+        editorRow *row = editorRowAt(editor.cy);
+        editor.cx = row && lastX <= row->size ? lastX : 0;
+        setStatusMessage("Recovered %d edits from the journal, Ctrl-S keeps them", replayed);
     }
 }
 
-void editorRowAppendString(editorRow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    if (!editor.stinky) {
-        editor.stinky = true;
+// Redoes one entry, unless it doesn't fit the buffer, which means the journal is no good from here on
+bool editorJournalApply(editorJournalEntry *entry, const char *s) {
+    editorRow *row = entry->y >= 0 && entry->y < editor.numRows ? editorRowAt(entry->y) : NULL;
+    switch (entry->type)
+    {
+        case UNDO_INSERT_CHARS:
+            if (row == NULL || entry->x < 0 || entry->x > row->size) return false;
+            editorRowInsertString(entry->y, entry->x, s, entry->length);
+            return true;
+        case UNDO_DELETE_CHARS:
+            if (row == NULL || entry->x < 0 || entry->x + entry->length > row->size) return false;
+            editorRowDelChars(entry->y, entry->x, entry->length);
+            return true;
+        case UNDO_INSERT_ROWS:
+        {
+            if (entry->y < 0 || entry->y > editor.numRows || entry->x < 1) return false;
+            const char *end = s + entry->length;
+            for (int i = 0; i < entry->x; i++) {
+                const char *newline = memchr(s, '\n', end - s);
+                if (i < entry->x - 1 ? newline == NULL : newline != NULL) return false;
+                if (i == entry->x - 1) newline = end;
+                editorInsertRow(entry->y + i, s, newline - s);
+                s = newline + 1;
+            }
+            return true;
+        }
+        case UNDO_DELETE_ROWS:
+            if (row == NULL || entry->x < 1 || entry->x > editor.numRows - entry->y) return false;
+            editorDelRows(entry->y, entry->x);
+            return true;
+        case JOURNAL_REPLACE:
+        {
+            if (entry->x < 1 || entry->x > entry->length) return false;
+            char *query = strndup(s, entry->x);
+            char *replacement = strndup(s + entry->x, entry->length - entry->x);
+            int rows;
+            editorReplaceText(query, replacement, &rows);
+            free(query);
+            free(replacement);
+            return true;
+        }
+    }
+    return false;
+}
+
+// FNV-1a over the entry's fields and its text
+unsigned int editorJournalChecksum(editorJournalEntry *entry, const char *s) {
+    unsigned int hash = 2166136261u;
+    const unsigned char *fields = (const unsigned char *) &entry->type;
+    for (size_t i = 0; i < sizeof(*entry) - sizeof(entry->check); i++) hash = (hash ^ fields[i]) * 16777619u;
+    for (int i = 0; i < entry->length; i++) hash = (hash ^ (unsigned char) s[i]) * 16777619u;
+    return hash;
+}
+
+void editorJournalStat(editorJournalHeader *header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "ZTJRNL1\n", 8);
+    header->pid = getpid();
+
+    struct stat st;
+    if (editor.fileName == NULL || stat(editor.fileName, &st) == -1) return;
+    header->size = st.st_size;
+    header->mtimeSec = st.st_mtim.tv_sec;
+    header->mtimeNsec = st.st_mtim.tv_nsec;
+    header->device = st.st_dev;
+    header->inode = st.st_ino;
+}
+
+// Takes note of the file as it is on disk, the one entries from now on apply to
+void editorJournalIdentify() {
+    editorJournal *journal = &editor.journal;
+    if (!journal->enabled) return;
+
+    editorJournalStat(&journal->header);
+    if (journal->fd != -1) pwrite(journal->fd, &journal->header, sizeof(journal->header), 0);
+}
+
+// Called for every primitive edit, from editorUndoRecord()
+void editorJournalRecord(int type, int y, int x, const char *s, int len) {
+    editorJournal *journal = &editor.journal;
+    if (!journal->enabled || journal->suspended || editor.fileName == NULL) return;
+
+    bool rows = type == UNDO_INSERT_ROWS || type == UNDO_DELETE_ROWS;
+
+    // Rows going in or out one after another, a paste or its undo, make a single entry
+    if (rows && journal->runOpen)
+    {
+        editorJournalEntry run;
+        memcpy(&run, journal->pending.b + journal->runEntry, sizeof(run));
+        bool next = type == UNDO_INSERT_ROWS ? y == run.y + run.x : y == run.y;
+        if (run.type == type && next && run.length < INT_MAX - len - 1)
+        {
+            run.x++;
+            run.length += len + 1;
+            memcpy(journal->pending.b + journal->runEntry, &run, sizeof(run));
+            abAppend(&journal->pending, "\n", 1);
+            abAppend(&journal->pending, s, len);
+            return;
+        }
+    }
+    editorJournalCloseRun();
+
+    editorJournalEntry entry = {0, type, y, rows ? 1 : x, len};
+    entry.check = editorJournalChecksum(&entry, s);
+    journal->runOpen = rows;
+    journal->runEntry = journal->pending.len;
+    abAppend(&journal->pending, (const char *) &entry, sizeof(entry));
+    abAppend(&journal->pending, s, len);
+
+    // Syncing waits for the key to be done, see processInputs()
+    journal->pendingOps++;
+    if (editor.timers[JOURNAL_TIMER].deadline == 0)
+    {
+        setTimer(JOURNAL_TIMER, monotonicMs() + ZTEXT_JOURNAL_MS, editorJournalFlush);
+    }
+}
+
+// A run of rows is done growing, its check can go in
+void editorJournalCloseRun() {
+    editorJournal *journal = &editor.journal;
+    if (!journal->runOpen) return;
+    journal->runOpen = false;
+
+    editorJournalEntry run;
+    memcpy(&run, journal->pending.b + journal->runEntry, sizeof(run));
+    run.check = editorJournalChecksum(&run, journal->pending.b + journal->runEntry + sizeof(run));
+    memcpy(journal->pending.b + journal->runEntry, &run, sizeof(run));
+}
+
+// A replace-all is one entry holding the query and the replacement, however many rows it touches
+void editorJournalReplace(const char *query, const char *replacement) {
+    size_t queryLength = strlen(query);
+    size_t replacementLength = strlen(replacement);
+    char *text = malloc(queryLength + replacementLength + 1);
+    memcpy(text, query, queryLength);
+    memcpy(text + queryLength, replacement, replacementLength);
+    editorJournalRecord(JOURNAL_REPLACE, 0, queryLength, text, queryLength + replacementLength);
+    free(text);
+}
+
+// Writes out the pending entries and syncs them, creating the journal if this is the first batch
+void editorJournalFlush() {
+    editorJournal *journal = &editor.journal;
+    setTimer(JOURNAL_TIMER, 0, NULL);
+    if (journal->pending.len == 0) return;
+    editorJournalCloseRun();
+
+    if (journal->fd == -1)
+    {
+        journal->path = editorJournalPath(editor.fileName);
+        journal->fd = open(journal->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        journal->length = sizeof(journal->header);
+        if (journal->fd != -1 && flock(journal->fd, LOCK_EX | LOCK_NB) == -1)
+        {
+            // Another ztext started on the file since we did, the journal is theirs
+            close(journal->fd);
+            journal->fd = -1;
+            free(journal->path);
+            journal->path = NULL;
+            journal->pending.len = 0;
+            journal->pendingOps = 0;
+            journal->enabled = false;
+            setStatusMessage("Another ztext is editing this file, no journal for this one");
+            return;
+        }
+        if (journal->fd != -1 && (ftruncate(journal->fd, 0) == -1 ||
+            pwrite(journal->fd, &journal->header, sizeof(journal->header), 0) != sizeof(journal->header)))
+        {
+            close(journal->fd);
+            journal->fd = -1;
+        }
+        if (journal->fd != -1)
+        {
+            // Make the new name itself durable
+            char *slash = strrchr(journal->path, '/');
+            char *dir = slash ? strndup(journal->path, slash - journal->path + 1) : strdup(".");
+            int dirFd = open(dir, O_RDONLY | O_DIRECTORY);
+            if (dirFd != -1)
+            {
+                fsync(dirFd);
+                close(dirFd);
+            }
+            free(dir);
+        }
+    }
+
+    const char *p = journal->pending.b;
+    long long left = journal->pending.len;
+    while (journal->fd != -1 && left > 0)
+    {
+        ssize_t written = pwrite(journal->fd, p, left, journal->length);
+        if (written == -1 && errno == EINTR) continue;
+        if (written <= 0) break;
+        p += written;
+        left -= written;
+        journal->length += written;
+    }
+
+    if (journal->fd == -1 || left > 0 || fdatasync(journal->fd) == -1)
+    {
+        // A journal with a hole in it would replay into garbage, better none at all
+        int error = errno;
+        editorJournalDiscard();
+        journal->enabled = false;
+        setStatusMessage("Journal off, cannot write it: %s", strerror(error));
+        return;
     }
+    journal->pending.len = 0;
+    journal->pendingOps = 0;
 }
 
-// Editor operations
+// A save is taking its snapshot, everything up to here will be in the file
+void editorJournalSaving() {
+    editorJournal *journal = &editor.journal;
+    if (!journal->enabled) return;
 
-void editorInsertChar(int c){
-    if (editor.cy == editor.numRows) editorInsertRow(editor.numRows,"", 0);
-    editorRowInsertChar(&editor.row[editor.cy], editor.cx, c);
-    editor.cx++;
+    editorJournalFlush();
+    journal->saveMark = journal->fd == -1 ? (long long) sizeof(journal->header) : journal->length;
 }
 
-void editorInsertNewLine() {
-    if (editor.cx == 0)
+// The file now has what the buffer had when the save started. Unless edits came in since,
+// the journal has nothing left to add
+void editorJournalSaved(bool clean) {
+    editorJournal *journal = &editor.journal;
+    if (!journal->enabled) return;
+
+    char *tail = NULL;
+    long long tailLength = 0;
+    if (!clean)
     {
-        editorInsertRow(editor.cy, "", 0);
-    }else
+        editorJournalFlush();
+        tailLength = journal->length - journal->saveMark;
+        if (journal->fd != -1 && tailLength > 0)
+        {
+            tail = malloc(tailLength);
+            if (preadAll(journal->fd, tail, tailLength, journal->saveMark) != tailLength) tailLength = 0;
+        }
+    }
+
+    editorJournalDiscard();
+    editorJournalIdentify();
+
+    // The edits made while the save ran start the next journal, against the new file
+    if (tail && tailLength > 0)
     {
-        editorRow *row = &editor.row[editor.cy];
-        editorInsertRow(editor.cy + 1, &row->chars[editor.cx], row->size - editor.cx);
-        row = &editor.row[editor.cy];
-        row->size = editor.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        abAppend(&journal->pending, tail, tailLength);
+        journal->pendingOps = 1;
+        editorJournalFlush();
     }
-    editor.cy++;
-    editor.cx = 0;
+    free(tail);
 }
 
-void editorDelChar() {
-    if (editor.cy == editor.numRows) return;
-    if (editor.cx == 0 && editor.cy == 0) return;
+void editorJournalDiscard() {
+    editorJournal *journal = &editor.journal;
+    setTimer(JOURNAL_TIMER, 0, NULL);
+    journal->pending.len = 0;
+    journal->pendingOps = 0;
+    journal->runOpen = false;
 
-    editorRow *row = &editor.row[editor.cy];
-    if (editor.cx > 0)
-    {
-        editorRowDelChar(row, editor.cx - 1);
-        editor.cx--;
-    }else
+    if (journal->fd != -1)
     {
-        editor.cx = editor.row[editor.cy - 1].size;
-        editorRowAppendString(&editor.row[editor.cy - 1], row->chars, row->size);
-        editorDelRow(editor.cy);
-        editor.cy--;
+        unlink(journal->path);
+        close(journal->fd);
     }
+    free(journal->path);
+    journal->path = NULL;
+    journal->fd = -1;
+    journal->length = 0;
 }
 
-// Input functions
+// Tracing
 
-char* editorPrompt(char *prompt) {
-    size_t bufSize = 128;
-    char *buf = malloc(bufSize);
+// With tracing on (--trace FILE, or the Ctrl-T HUD) every frame leaves a record in a ring
+// of the last ZTEXT_TRACE_FRAMES: time spent decoding keys, handling them, scrolling,
+// drawing and writing, plus bytes out and allocations. With it off, every timestamp is a
+// branch that doesn't take
 
-    size_t bufLength = 0;
-    buf[0] = '\0';
+void editorTraceStart(const char *fileName) {
+    editorTrace *trace = &editor.trace;
+    if (trace->frames == NULL)
+    {
+        trace->frames = calloc(ZTEXT_TRACE_FRAMES, sizeof(editorTraceFrame));
+        if (trace->frames == NULL) printEditorError("Cannot allocate trace");
+    }
+    if (!trace->enabled) memset(&trace->current, 0, sizeof(trace->current));
+    trace->enabled = true;
 
-    while (true)
+    if (fileName && trace->fileName == NULL)
     {
-        setStatusMessage(prompt, buf);
-        refreshScreen();
+        trace->fileName = strdup(fileName);
+        atexit(editorTraceDump);
+    }
+}
 
-        int c = readKey();
+// Nanoseconds on the monotonic clock while tracing, 0 without even asking the clock otherwise
+long long editorTraceClock() {
+    if (!editor.trace.enabled) return 0;
 
-        if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
-        {
-            if (bufLength != 0) buf[--bufLength] = '\0';
-        }else if (c == '\x1b')
-        {
-            setStatusMessage("");
-            free(buf);
-            return NULL;
-        }else if (c == '\r')
-        {
-            if (bufLength != 0)
-            {
-                setStatusMessage("");
-                return buf;
-            }
-        }else if (!iscntrl(c) && c < 128)
-        {
-            if (bufLength == bufSize - 1)
-            {
-                bufSize *= 2;
-                buf = realloc(buf, bufSize);
-            }
-            buf[bufLength++] = c;
-            buf[bufLength] = '\0';
-        }
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void moveCursor(int c){
+// A key was decoded between start and decoded, and handled by end. It counts towards the next frame
+void editorTraceKey(long long start, long long decoded, long long end) {
+    editorTraceFrame *frame = &editor.trace.current;
+    if (frame->keys == 0) frame->start = start;
+    frame->stages[TRACE_READ] += decoded - start;
+    frame->stages[TRACE_HANDLE] += end - decoded;
+    frame->keys++;
+}
 
-    editorRow *row = editor.cy >= editor.numRows ? NULL : &editor.row[editor.cy];
+// refreshScreen() scrolled from start, drew from scrolled and wrote from drawn until end
+void editorTraceFrameDone(long long start, long long scrolled, long long drawn, long long end) {
+    editorTrace *trace = &editor.trace;
+    editorTraceFrame *frame = &trace->current;
 
-    switch(c){
-        case ARROW_UP:
-            if(editor.cy != 0)
-            {
-                editor.cy--;
-            }
-            break;
-        case ARROW_LEFT:
-            if(editor.cx != 0)
-            {
-                editor.cx--;
-            }else if(editor.cy > 0)
-            {
-                editor.cy--;
-                editor.cx = editor.row[editor.cy].size;
-            }
-            break;
-        case ARROW_DOWN:
-            if(editor.cy < editor.numRows)
-            {
-                editor.cy++;
-            }
-            break;
-        case ARROW_RIGHT:
-            if(row && editor.cx < row->size)
-            {
-                editor.cx++;
-            }else if (row && editor.cx == row->size)
-            {
-                editor.cy++;
-                editor.cx = 0;
-            }
-            break;
-    }
+    // Frames nobody typed for (timers, resizes, saves landing) start with the redraw
+    if (frame->keys == 0) frame->start = start;
+    frame->refresh = start;
+    frame->stages[TRACE_SCROLL] = scrolled - start;
+    frame->stages[TRACE_DRAW] = drawn - scrolled;
+    frame->stages[TRACE_WRITE] = end - drawn;
+    frame->bytes = editor.frameBytes;
+    frame->allocations = editor.frameAllocations;
 
-    row = (editor.cy >= editor.numRows) ? NULL : &editor.row[editor.cy];
-    int rowLength = row ? row->size : 0;
-    if (editor.cx > rowLength) {
-        editor.cx = rowLength;
-    }
+    trace->frames[trace->count % ZTEXT_TRACE_FRAMES] = *frame;
+    trace->count++;
+    memset(frame, 0, sizeof(*frame));
 }
 
-void processInputs(){
-    static int quit_times = ZTEXT_QUIT_TIMES;
+// Ctrl-T, the last frame's numbers in the status bar. Turning it on starts tracing if --trace didn't
+void editorTraceToggleHud() {
+    editorTrace *trace = &editor.trace;
+    trace->hud = !trace->hud;
+    if (trace->hud) editorTraceStart(NULL);
+    else if (trace->fileName == NULL) trace->enabled = false;
+}
 
-    int c = readKey();
+// The newest finished frame, NULL before there is one
+editorTraceFrame* editorTraceLast() {
+    editorTrace *trace = &editor.trace;
+    if (!trace->enabled || trace->count == 0) return NULL;
+    return &trace->frames[(trace->count - 1) % ZTEXT_TRACE_FRAMES];
+}
 
-    switch (c)
-    {
-        case '\r':
-            editorInsertNewLine();
-            break;
-        case CTRL_KEY('q'):
-            if (editor.stinky && quit_times > 0) {
-                setStatusMessage("WARNING! File has unsaved changes."
-                    "Press Ctrl-Q %d more time(s) to quit", quit_times);
-                quit_times--;
-                return;
-            }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
-            exit(0);
-        case CTRL_KEY('s'):
-            editorSaveFile();
-            break;
-        case HOME_KEY:
-            editor.cx = 0;
-            break;
-        case END_KEY:
-            if (editor.cy < editor.numRows)
-                editor.cx = editor.row[editor.cy].size;
-            break;
-        case BACKSPACE:
-        case CTRL_KEY('h'):
-        case DELETE_KEY:
-            if (c == DELETE_KEY) moveCursor(ARROW_RIGHT);
-            editorDelChar();
-            break;
-        case PAGE_UP:
-        case PAGE_DOWN:
-            {
-                if(c == PAGE_UP)
-                {
-                    editor.cy = editor.rowOffset;
-                }else
-                {
-                    editor.cy = editor.rowOffset + editor.terminalRows - 1;
-                    if (editor.cy > editor.numRows) editor.cy = editor.numRows;
-                }
+// Writes the ring out as Chrome trace events (chrome://tracing, Perfetto), a complete
+// event per frame with one per stage nested inside. Runs at exit
+void editorTraceDump() {
+    static const char *names[TRACE_STAGES] = {"readKey", "processKey", "editorScroll", "draw", "write"};
+    editorTrace *trace = &editor.trace;
 
-                int times = editor.terminalRows;
-                while(times--)
-                {
-                    moveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-                }
-            }
-            break;
-        case ARROW_UP:
-        case ARROW_DOWN:
-        case ARROW_LEFT:
-        case ARROW_RIGHT:
-            moveCursor(c);
-            break;
-        case CTRL_KEY('l'):
-        case '\x1b':
-            break;
-        default:
-            editorInsertChar(c);
-            break;
-    }
+    FILE *file = fopen(trace->fileName, "w");
+    if (file == NULL) return;
 
-    quit_times = ZTEXT_QUIT_TIMES;
+    long long first = trace->count > ZTEXT_TRACE_FRAMES ? trace->count - ZTEXT_TRACE_FRAMES : 0;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (long long i = first; i < trace->count; i++) {
+        editorTraceFrame *frame = &trace->frames[i % ZTEXT_TRACE_FRAMES];
+        long long input = frame->stages[TRACE_READ] + frame->stages[TRACE_HANDLE];
+        long long end = frame->refresh + frame->stages[TRACE_SCROLL] + frame->stages[TRACE_DRAW] + frame->stages[TRACE_WRITE];
+
+        fprintf(file, "%s{\"name\": \"frame\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, "
+            "\"args\": {\"keys\": %d, \"bytes\": %ld, \"allocations\": %ld}}",
+            i == first ? "" : ",\n", frame->start / 1e3, (end - frame->start) / 1e3,
+            frame->keys, frame->bytes, frame->allocations);
+
+        // Key handling is summed over the frame's keys, laid out back to back from its start
+        long long at[TRACE_STAGES] = {
+            frame->start,
+            frame->start + frame->stages[TRACE_READ],
+            frame->refresh,
+            frame->refresh + frame->stages[TRACE_SCROLL],
+            frame->refresh + frame->stages[TRACE_SCROLL] + frame->stages[TRACE_DRAW]
+        };
+        for (int stage = 0; stage < TRACE_STAGES; stage++) {
+            if (frame->stages[stage] == 0 || (stage <= TRACE_HANDLE && input == 0)) continue;
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}",
+                names[stage], at[stage] / 1e3, frame->stages[stage] / 1e3);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
 }
 
 // Appending the buffer
 
-void abAppend(struct appendBuffer *ab, const char *s, int len){
-    char *new = realloc(ab->b, ab->len + len);
+bool abReserve(struct appendBuffer *ab, int needed){
+    if(needed <= ab->capacity) return true;
 
-    if(new == NULL) return;
-    memcpy(&new[ab->len], s, len);
+    int capacity = ab->capacity ? ab->capacity : ZTEXT_ABUF_MIN_CAPACITY;
+    while(capacity < needed) capacity *= 2;
+
+    char *new = realloc(ab->b, capacity);
+    if(new == NULL) return false;
     ab->b = new;
+    ab->capacity = capacity;
+    editor.allocations++;
+    return true;
+}
+
+void abAppend(struct appendBuffer *ab, const char *s, int len){
+    if(len == 0) return;
+    if(!abReserve(ab, ab->len + len)) return;
+
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
+void abPad(struct appendBuffer *ab, char c, int count){
+    if(count <= 0) return;
+    if(!abReserve(ab, ab->len + count)) return;
+
+    memset(&ab->b[ab->len], c, count);
+    ab->len += count;
+}
+
 void abFree(struct appendBuffer *ab){
     free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->capacity = 0;
 }
 
 // Output functions
 
-void drawRows(struct appendBuffer *ab){
+void drawRows(struct appendBuffer *ab, struct appendBuffer *line){
     for(int i = 0; i < editor.terminalRows; i++)
     {
-        int fileRow = i + editor.rowOffset;
-        if(fileRow >= editor.numRows)
+        line->len = 0;
+        drawRow(line, i);
+        emitLine(ab, i, line);
+    }
+}
+
+void drawRow(struct appendBuffer *line, int i){
+    int fileRow = i + editor.rowOffset;
+    if(fileRow >= editor.numRows)
+    {
+        if(editor.numRows == 0 && i == editor.terminalRows / 3)
         {
-            if(editor.numRows == 0 && i == editor.terminalRows / 3)
+            char welcome[80];
+            int welcomeLength = snprintf(welcome, sizeof(welcome),
+            "ZText -- Version %s", ZTEXT_VERSION);
+
+            if(welcomeLength > editor.terminalColumns)
             {
-                char welcome[80];
-                int welcomeLength = snprintf(welcome, sizeof(welcome),
-                "ZText -- Version %s", ZTEXT_VERSION);
+                welcomeLength = editor.terminalColumns;
+            }
 
-                if(welcomeLength > editor.terminalColumns)
-                {
-                    welcomeLength = editor.terminalColumns;
-                }
+            int padding = (editor.terminalColumns - welcomeLength) / 2;
+            if(padding)
+            {
+                abAppend(line, "~", 1);
+                padding--;
+            }
+            abPad(line, ' ', padding);
 
-                int padding = (editor.terminalColumns - welcomeLength) / 2;
-                if(padding)
-                {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while(padding--) abAppend(ab, " ", 1);
+            abAppend(line, welcome, welcomeLength);
+        }
+        else
+        {
+            abAppend(line, "~", 1);
+        }
+    }else if (editor.syntax == NULL || editorRowAt(fileRow)->size >= ZTEXT_LONG_LINE)
+    {
+        int renderSize;
+        editorRow *row = editorRowAt(fileRow);
+        char *render = editorRowRender(row, &renderSize);
 
-                abAppend(ab, welcome, welcomeLength);
-            }
-            else
+        int from, padLeft, padRight;
+        int to = editorVisibleRender(row, renderSize, &from, &padLeft, &padRight);
+        abPad(line, ' ', padLeft);
+        if (to > from) abAppend(line, &render[from], to - from);
+        abPad(line, ' ', padRight);
+    }else
+    {
+        char *render;
+        int renderSize;
+        unsigned char *hl = editorRowHighlight(fileRow, &render, &renderSize);
+
+        int from, padLeft, padRight;
+        int end = editorVisibleRender(editorRowAt(fileRow), renderSize, &from, &padLeft, &padRight);
+        abPad(line, ' ', padLeft);
+
+        // Same colored bytes go out as one run, with an escape only where the color changes
+        int color = 39;
+        int j = from;
+        while (j < end)
+        {
+            int runColor = editorSyntaxToColor(hl[j]);
+            int runEnd = j + 1;
+            while (runEnd < end && editorSyntaxToColor(hl[runEnd]) == runColor) runEnd++;
+
+            if (runColor != color)
             {
-                abAppend(ab , "~", 1);
+                char buf[16];
+                int bufLength = snprintf(buf, sizeof(buf), "\x1b[%dm", runColor);
+                abAppend(line, buf, bufLength);
+                color = runColor;
             }
-        }else
-        {
-            int len = editor.row[fileRow].renderSize - editor.columnOffset;
-            if (len < 0) len = 0;
-            if (len >= editor.terminalColumns) len = editor.terminalColumns;
-            abAppend(ab, &editor.row[fileRow].render[editor.columnOffset], len);
+            abAppend(line, &render[j], runEnd - j);
+            j = runEnd;
         }
+        if (color != 39) abAppend(line, "\x1b[39m", 5);
+        abPad(line, ' ', padRight);
+    }
+}
+
+// Printable ASCII only, so byte offsets are also screen columns
+bool isPlainLine(struct appendBuffer *line){
+    for (int i = 0; i < line->len; i++) {
+        if (line->b[i] < ' ' || line->b[i] > '~') return false;
+    }
+    return true;
+}
 
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
+// Brings screen line y up to date with the freshly drawn line, writing only what differs
+bool emitLine(struct appendBuffer *ab, int y, struct appendBuffer *line){
+    struct appendBuffer *shown = &editor.screen[y];
+    if (shown->len == line->len && (line->len == 0 || memcmp(shown->b, line->b, line->len) == 0)) return false;
+
+    int start = 0;
+    int end = line->len;
+    bool clear = true;
+
+    if (isPlainLine(shown) && isPlainLine(line))
+    {
+        int common = shown->len < line->len ? shown->len : line->len;
+        while (start < common && shown->b[start] == line->b[start]) start++;
+
+        if (shown->len == line->len)
+        {
+            // Same length, so only the span between the first and last difference needs rewriting
+            while (end > start && shown->b[end - 1] == line->b[end - 1]) end--;
+            clear = false;
+        }else if (line->len > shown->len)
+        {
+            clear = false;
+        }
     }
+
+    char buf[32];
+    int bufLength = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, start + 1);
+    abAppend(ab, buf, bufLength);
+    if (clear) abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, &line->b[start], end - start);
+
+    shown->len = 0;
+    abAppend(shown, line->b, line->len);
+    return true;
+}
+
+// Drops the shadow copy of the screen, the next frame repaints everything
+void resizeScreen(){
+    for (int i = 0; i < editor.screenLines; i++) abFree(&editor.screen[i]);
+    free(editor.screen);
+
+    editor.screenLines = editor.terminalRows + 2;
+    editor.screen = calloc(editor.screenLines, sizeof(struct appendBuffer));
+    if (editor.screen == NULL) printEditorError("Cannot allocate screen");
+    editor.allocations++;
 }
 
 void drawStatusBar(struct appendBuffer *ab) {
     abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-      editor.fileName ? editor.fileName : "[No Name]", editor.numRows,
+    char status[80], rstatus[80], loading[24] = "";
+    if (editor.load.running)
+        snprintf(loading, sizeof(loading), " (loading %d%%)", (int) (editor.load.loaded * 100 / editor.load.size));
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines%s %s",
+      editor.fileName ? editor.fileName : "[No Name]", editor.numRows, loading,
       editor.stinky ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-      editor.cy + 1, editor.numRows);
-    if (len > editor.terminalColumns) len = editor.terminalColumns;
-    abAppend(ab, status, len);
-    while (len < editor.terminalColumns) {
-        if (editor.terminalColumns - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+      editor.syntax ? editor.syntax->fileType : "no ft", editor.cy + 1, editor.numRows);
+    if (editor.view.active) {
+        // Line numbers are the file's, not the rows'. Either one may not be known yet
+        editorViewer *view = &editor.view;
+        char line[24] = "?", lines[24] = "?";
+        if (view->firstLine >= 0) snprintf(line, sizeof(line), "%lld", view->firstLine + editor.cy + 1);
+        if (view->indexDone && view->error == 0) {
+            snprintf(lines, sizeof(lines), "%lld", view->lines);
+            len = snprintf(status, sizeof(status), "%.20s - %lld lines (read only)", editor.fileName, view->lines);
+        } else if (view->indexDone) {
+            len = snprintf(status, sizeof(status), "%.20s - %lld bytes (read only)", editor.fileName, view->size);
         } else {
-            abAppend(ab, " ", 1);
-            len++;
+            len = snprintf(status, sizeof(status), "%.20s - indexing %d%% (read only)", editor.fileName,
+              view->size ? (int) (view->indexed * 100 / view->size) : 100);
         }
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %s/%s",
+          editor.syntax ? editor.syntax->fileType : "no ft", line, lines);
+    }
+    editorTraceFrame *last = editor.trace.hud ? editorTraceLast() : NULL;
+    if (last) {
+        long long ms = last->refresh - last->start;
+        for (int stage = TRACE_SCROLL; stage < TRACE_STAGES; stage++) ms += last->stages[stage];
+        rlen = snprintf(rstatus, sizeof(rstatus), "%.2f ms %ld B %ld allocs | %d/%d",
+          ms / 1e6, last->bytes, last->allocations, editor.cy + 1, editor.numRows);
+    }
+    if (len > editor.terminalColumns) len = editor.terminalColumns;
+    abAppend(ab, status, len);
+    int gap = editor.terminalColumns - len;
+    if (gap >= rlen) {
+        abPad(ab, ' ', gap - rlen);
+        abAppend(ab, rstatus, rlen);
+    } else {
+        abPad(ab, ' ', gap);
     }
     abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
 }
 
 void drawMessageBar(struct appendBuffer *ab) {
-    abAppend(ab, "\x1b[K", 3);
     int messageLength = strlen(editor.statusMsg);
     if(messageLength > editor.terminalColumns)
+    {
+        // Don't leave half a character behind
         messageLength = editor.terminalColumns;
-    if (messageLength && time(NULL) - editor.statusMsg_time < 5)
+        while (messageLength > 0 && (editor.statusMsg[messageLength] & 0xC0) == 0x80) messageLength--;
+    }
+    if (messageLength && monotonicMs() - editor.statusMsg_time < ZTEXT_STATUS_TIMEOUT_MS)
         abAppend(ab, editor.statusMsg, messageLength);
 }
 
 void refreshScreen(){
+    long long began = editorTraceClock();
     editorScroll();
+    long long scrolled = editorTraceClock();
 
-    struct appendBuffer ab = ABUF_INIT;
+    long allocations = editor.allocations;
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
+    struct appendBuffer *ab = &editor.frame;
+    struct appendBuffer *line = &editor.frameLine;
+    ab->len = 0;
 
-    drawRows(&ab);
-    drawStatusBar(&ab);
-    drawMessageBar(&ab);
+    abAppend(ab, "\x1b[?25l", 6);
+    int hidden = ab->len;
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",  (editor.cy - editor.rowOffset) + 1,
-                                                            (editor.rx - editor.columnOffset) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    if (editor.screenLines != editor.terminalRows + 2) editor.screenValid = false;
+    if (!editor.screenValid)
+    {
+        resizeScreen();
+        abAppend(ab, "\x1b[2J", 4);
+        editor.screenValid = true;
+    }
+
+    drawRows(ab, line);
+
+    line->len = 0;
+    drawStatusBar(line);
+    emitLine(ab, editor.terminalRows, line);
+
+    line->len = 0;
+    drawMessageBar(line);
+    emitLine(ab, editor.terminalRows + 1, line);
+
+    int cursorRow = (editor.cy - editor.rowOffset) + 1;
+    int cursorColumn = (editor.rx - editor.columnOffset) + 1;
+    bool damaged = ab->len > hidden;
+
+    if (damaged || cursorRow != editor.screenCursorRow || cursorColumn != editor.screenCursorColumn)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cursorRow, cursorColumn);
+        abAppend(ab, buf, strlen(buf));
+        editor.screenCursorRow = cursorRow;
+        editor.screenCursorColumn = cursorColumn;
+    }
 
-    abAppend(&ab, "\x1b[?25h", 6);
+    // A bare cursor move doesn't need the cursor hidden around it
+    int start = damaged ? 0 : hidden;
+    if (damaged) abAppend(ab, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    editor.frameBytes = ab->len - start;
+    editor.totalBytes += editor.frameBytes;
+    editor.frames++;
+    editor.frameAllocations = editor.allocations - allocations;
+
+    long long drawn = editorTraceClock();
+    if (editor.frameBytes) writeAll(STDOUT_FILENO, ab->b + start, editor.frameBytes);
+    if (editor.trace.enabled) editorTraceFrameDone(began, scrolled, drawn, editorTraceClock());
+}
+
+// Pushes a whole buffer out in as few writes as the terminal allows,
+// picking up after short writes and waiting out EAGAIN on a non-blocking fd
+int writeAll(int fd, const char *buf, int len){
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Reads until length bytes are in or the file ends, returns how many made it
+long long preadAll(int fd, char *buf, long long length, long long offset){
+    long long got = 0;
+    while (got < length)
+    {
+        ssize_t nRead = pread(fd, buf + got, length - got, offset + got);
+        if (nRead == -1 && errno == EINTR) continue;
+        if (nRead <= 0) break;
+        got += nRead;
+    }
+    return got;
 }
 
 void editorScroll() {
     editor.rx = 0;
     if(editor.cy < editor.numRows)
     {
-        editor.rx = editorRowCxToRx(&editor.row[editor.cy], editor.cx);
+        editor.rx = editorRowCxToRx(editorRowAt(editor.cy), editor.cx);
     }
 
     if(editor.cy < editor.rowOffset)
@@ -835,5 +6436,8 @@ void setStatusMessage(const char *fmt, ...) {
     va_start(ap, fmt);
     vsnprintf(editor.statusMsg, sizeof(editor.statusMsg), fmt, ap);
     va_end(ap);
-    editor.statusMsg_time = time(NULL);
+    editor.statusMsg_time = monotonicMs();
+
+    // Nothing to run on expiry, waking up is enough for the next frame to drop the message
+    setTimer(STATUS_TIMER, editor.statusMsg_time + ZTEXT_STATUS_TIMEOUT_MS, NULL);
 }